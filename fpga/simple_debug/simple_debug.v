@@ -45,6 +45,33 @@ module simple_debug(
    reg irq = 0;
    assign irq_o = irq;
 
+   // irq sources, status bits follow the same order
+   localparam IRQ_SRC_COUNTER = 0; // internal counter wrapped
+   localparam IRQ_SRC_HOST = 1;    // rising edge of irq_i
+   localparam IRQ_SRC_SOFT = 2;    // write to IRQ_REG_RAISE
+   // irq registers at the start of cs0
+   localparam IRQ_REG_STATUS = 26'h0; // pending sources, write 1 to clear
+   localparam IRQ_REG_EVENTS = 26'h2; // events since the last ack, write subtracts
+   localparam IRQ_REG_COUNT = 26'h4;  // irq is raised once that many events are pending
+   localparam IRQ_REG_TIME = 26'h6;   // or once the oldest one is that many x256 clocks old, 0 is off
+   localparam IRQ_REG_RAISE = 26'h8;  // any write is a software event
+
+   reg [15:0] irq_status = 0;
+   reg [15:0] irq_events = 0;
+   reg [15:0] irq_count = 1;
+   reg [15:0] irq_time = 0;
+   reg [23:0] irq_age = 0;    // clocks since the oldest pending event
+   reg [1:0] irq_i_sync = 0;  // irq_i synchronized, older sample in MSB
+   wire [15:0] irq_src;
+   assign irq_src[IRQ_SRC_COUNTER] = (counter == 32'hFFFFFFFF);
+   assign irq_src[IRQ_SRC_HOST] = (irq_i_sync == 2'b01);
+   assign irq_src[IRQ_SRC_SOFT] = 0; // set by the write itself
+   assign irq_src[15:3] = 0;
+   wire [1:0] irq_src_num = irq_src[IRQ_SRC_COUNTER] + irq_src[IRQ_SRC_HOST];
+   // events saturate instead of wrapping to 0
+   wire [15:0] irq_events_next = (irq_events > 16'hFFFF - irq_src_num) ? 16'hFFFF : (irq_events + irq_src_num);
+   wire irq_timeout = (irq_time != 0) && (irq_age[23:8] >= irq_time);
+
    // iobuf instance
    genvar y;
    generate
@@ -65,7 +92,7 @@ module simple_debug(
    parameter RAM_SIZE_LOG2 = 5;
    // x2 since we're addressing by 16 bits
    wire ram_accessed = (({cs_i[0], addr_i} >= RAM_ADDRESS_START) && ({cs_i[0], addr_i} < (RAM_ADDRESS_START + RAM_SIZE*2))) ? 1 : 0;
-	wire clear_irq = ({cs_i[0], addr_i} == 25'h0);
+   wire [25:0] reg_addr = {cs_i[0], addr_i};
 
    wire [DATA_WIDTH - 1:0] ram_d;
    // TODO: use proper log2()
@@ -95,14 +122,20 @@ module simple_debug(
          stage_1 <= 0;
          data_from_iface <= 0;
          irq <= 0;
+         irq_status <= 0;
+         irq_events <= 0;
+         irq_age <= 0;
+         irq_i_sync <= 0;
       end
       else
       begin
-			if (counter == 32'hFFFFFFFF)
-			begin
-				irq <= 1;
-			end
          counter <= counter + 1;
+         irq_i_sync <= {irq_i_sync[0], irq_i};
+         // register writes below override these
+         irq_status <= irq_status | irq_src;
+         irq_events <= irq_events_next;
+         irq_age <= (irq_events == 0) ? 0 : ((irq_age == 24'hFFFFFF) ? irq_age : irq_age + 1);
+         irq <= (irq_events != 0) && ((irq_events >= irq_count) || irq_timeout);
          // store chipselect stuff into flip-flops
          stage_3 <= stage_2;
          stage_2 <= stage_1;
@@ -118,8 +151,14 @@ module simple_debug(
                end
                else
                begin
-                  // LSB of address is 0 due to 16 bit data transactions, so add cs
-                  data_from_iface <= (addr_i[DATA_WIDTH - 1:0] | cs_i[0]);
+                  case (reg_addr)
+                     IRQ_REG_STATUS: data_from_iface <= irq_status;
+                     IRQ_REG_EVENTS: data_from_iface <= irq_events;
+                     IRQ_REG_COUNT: data_from_iface <= irq_count;
+                     IRQ_REG_TIME: data_from_iface <= irq_time;
+                     // LSB of address is 0 due to 16 bit data transactions, so add cs
+                     default: data_from_iface <= (addr_i[DATA_WIDTH - 1:0] | cs_i[0]);
+                  endcase
                end
             end
             // get data to fpga
@@ -127,15 +166,24 @@ module simple_debug(
             begin
                if (!ram_accessed)
                begin
-						if (clear_irq)
-						begin
-							irq <= data_to_iface[0];
-						end
-						else
-						begin
-	                  // skip LSB due to 16 bit data transactions
-	                  stored_data <= data_to_iface;
-						end
+                  case (reg_addr)
+                     IRQ_REG_STATUS: irq_status <= (irq_status & ~data_to_iface) | irq_src;
+                     // events counted meanwhile stay pending
+                     IRQ_REG_EVENTS:
+                     begin
+                        irq_events <= irq_events_next - data_to_iface;
+                        irq_age <= 0;
+                     end
+                     IRQ_REG_COUNT: irq_count <= data_to_iface;
+                     IRQ_REG_TIME: irq_time <= data_to_iface;
+                     IRQ_REG_RAISE:
+                     begin
+                        irq_status <= irq_status | irq_src | (16'h1 << IRQ_SRC_SOFT);
+                        irq_events <= (irq_events_next == 16'hFFFF) ? irq_events_next : (irq_events_next + 1);
+                     end
+                     // skip LSB due to 16 bit data transactions
+                     default: stored_data <= data_to_iface;
+                  endcase
                end
             end
          end
@@ -0,0 +1,257 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sk_fpga
+
+#if !defined(SK_FPGA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SK_FPGA_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Events live in /sys/kernel/debug/tracing/events/sk_fpga, disabled ones cost a static branch
+
+TRACE_DEFINE_ENUM(DMA_ARM_TO_FPGA);
+TRACE_DEFINE_ENUM(DMA_FPGA_TO_ARM);
+TRACE_DEFINE_ENUM(SK_FPGA_PROG_GPIO);
+TRACE_DEFINE_ENUM(SK_FPGA_PROG_PIO);
+
+#define sk_fpga_show_dir(dir) __print_symbolic(dir,         \
+        { DMA_ARM_TO_FPGA, "to_fpga" },                     \
+        { DMA_FPGA_TO_ARM, "to_arm" })
+
+#define sk_fpga_show_engine(engine) __print_symbolic(engine, \
+        { SK_FPGA_PROG_GPIO, "gpio" },                       \
+        { SK_FPGA_PROG_PIO,  "pio" })
+
+TRACE_EVENT(sk_fpga_ioctl_enter,
+    TP_PROTO(unsigned int cmd, unsigned long arg),
+    TP_ARGS(cmd, arg),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(unsigned long, arg)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->arg = arg;
+    ),
+    TP_printk("nr=%u cmd=0x%08x arg=0x%lx", _IOC_NR(__entry->cmd), __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(sk_fpga_ioctl_exit,
+    TP_PROTO(unsigned int cmd, long ret),
+    TP_ARGS(cmd, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+    TP_printk("nr=%u cmd=0x%08x ret=%ld", _IOC_NR(__entry->cmd), __entry->cmd, __entry->ret)
+);
+
+// single word accesses of SKFPGA_IOSDATA and SKFPGA_IOGDATA
+TRACE_EVENT(sk_fpga_word,
+    TP_PROTO(int sel, uint32_t addr, uint16_t data, bool write),
+    TP_ARGS(sel, addr, data, write),
+    TP_STRUCT__entry(
+        __field(int, sel)
+        __field(uint32_t, addr)
+        __field(uint16_t, data)
+        __field(bool, write)
+    ),
+    TP_fast_assign(
+        __entry->sel = sel;
+        __entry->addr = addr;
+        __entry->data = data;
+        __entry->write = write;
+    ),
+    TP_printk("%s cs%d addr=0x%x data=0x%04x", __entry->write ? "write" : "read",
+              __entry->sel - 1, __entry->addr, __entry->data)
+);
+
+DECLARE_EVENT_CLASS(sk_fpga_data,
+    TP_PROTO(int sel, loff_t pos, size_t len, ssize_t ret, bool dma),
+    TP_ARGS(sel, pos, len, ret, dma),
+    TP_STRUCT__entry(
+        __field(int, sel)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+        __field(bool, dma)
+    ),
+    TP_fast_assign(
+        __entry->sel = sel;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->dma = dma;
+    ),
+    TP_printk("cs%d pos=0x%llx len=%zu ret=%zd %s", __entry->sel - 1, (long long)__entry->pos,
+              __entry->len, __entry->ret, __entry->dma ? "dma" : "pio")
+);
+
+DEFINE_EVENT(sk_fpga_data, sk_fpga_read,
+    TP_PROTO(int sel, loff_t pos, size_t len, ssize_t ret, bool dma),
+    TP_ARGS(sel, pos, len, ret, dma)
+);
+
+DEFINE_EVENT(sk_fpga_data, sk_fpga_write,
+    TP_PROTO(int sel, loff_t pos, size_t len, ssize_t ret, bool dma),
+    TP_ARGS(sel, pos, len, ret, dma)
+);
+
+TRACE_EVENT(sk_fpga_mmap,
+    TP_PROTO(int sel, unsigned long off, unsigned long len, int ret),
+    TP_ARGS(sel, off, len, ret),
+    TP_STRUCT__entry(
+        __field(int, sel)
+        __field(unsigned long, off)
+        __field(unsigned long, len)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->sel = sel;
+        __entry->off = off;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+    TP_printk("sel=%d off=0x%lx len=%lu ret=%d", __entry->sel, __entry->off, __entry->len, __entry->ret)
+);
+
+// addr is the fpga side of the transfer, mem the memory side
+TRACE_EVENT(sk_fpga_dma_prep,
+    TP_PROTO(dma_addr_t addr, dma_addr_t mem, size_t len, int dir),
+    TP_ARGS(addr, mem, len, dir),
+    TP_STRUCT__entry(
+        __field(dma_addr_t, addr)
+        __field(dma_addr_t, mem)
+        __field(size_t, len)
+        __field(int, dir)
+    ),
+    TP_fast_assign(
+        __entry->addr = addr;
+        __entry->mem = mem;
+        __entry->len = len;
+        __entry->dir = dir;
+    ),
+    TP_printk("addr=0x%llx mem=0x%llx len=%zu %s", (unsigned long long)__entry->addr,
+              (unsigned long long)__entry->mem, __entry->len, sk_fpga_show_dir(__entry->dir))
+);
+
+TRACE_EVENT(sk_fpga_dma_submit,
+    TP_PROTO(int cookie, size_t len, int dir),
+    TP_ARGS(cookie, len, dir),
+    TP_STRUCT__entry(
+        __field(int, cookie)
+        __field(size_t, len)
+        __field(int, dir)
+    ),
+    TP_fast_assign(
+        __entry->cookie = cookie;
+        __entry->len = len;
+        __entry->dir = dir;
+    ),
+    TP_printk("cookie=%d len=%zu %s", __entry->cookie, __entry->len, sk_fpga_show_dir(__entry->dir))
+);
+
+// cookie is the dmaengine one for data path, the driver one for SKFPGA_IOSDMA and SKFPGA_IOSDMASUBMIT
+TRACE_EVENT(sk_fpga_dma_complete,
+    TP_PROTO(int cookie, size_t len, int dir, int status),
+    TP_ARGS(cookie, len, dir, status),
+    TP_STRUCT__entry(
+        __field(int, cookie)
+        __field(size_t, len)
+        __field(int, dir)
+        __field(int, status)
+    ),
+    TP_fast_assign(
+        __entry->cookie = cookie;
+        __entry->len = len;
+        __entry->dir = dir;
+        __entry->status = status;
+    ),
+    TP_printk("cookie=%d len=%zu %s status=%d", __entry->cookie, __entry->len,
+              sk_fpga_show_dir(__entry->dir), __entry->status)
+);
+
+TRACE_EVENT(sk_fpga_irq,
+    TP_PROTO(int irq, int level),
+    TP_ARGS(irq, level),
+    TP_STRUCT__entry(
+        __field(int, irq)
+        __field(int, level)
+    ),
+    TP_fast_assign(
+        __entry->irq = irq;
+        __entry->level = level;
+    ),
+    TP_printk("irq=%d %s", __entry->irq, __entry->level ? "rising" : "falling")
+);
+
+TRACE_EVENT(sk_fpga_irq_ack,
+    TP_PROTO(uint16_t status, uint16_t events, bool polled),
+    TP_ARGS(status, events, polled),
+    TP_STRUCT__entry(
+        __field(uint16_t, status)
+        __field(uint16_t, events)
+        __field(bool, polled)
+    ),
+    TP_fast_assign(
+        __entry->status = status;
+        __entry->events = events;
+        __entry->polled = polled;
+    ),
+    TP_printk("status=0x%04x events=%u %s", __entry->status, __entry->events,
+              __entry->polled ? "poll" : "irq")
+);
+
+TRACE_EVENT(sk_fpga_prog_prepare,
+    TP_PROTO(int engine, int ret),
+    TP_ARGS(engine, ret),
+    TP_STRUCT__entry(
+        __field(int, engine)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->engine = engine;
+        __entry->ret = ret;
+    ),
+    TP_printk("engine=%s ret=%d", sk_fpga_show_engine(__entry->engine), __entry->ret)
+);
+
+TRACE_EVENT(sk_fpga_prog_shift,
+    TP_PROTO(int engine, uint32_t len),
+    TP_ARGS(engine, len),
+    TP_STRUCT__entry(
+        __field(int, engine)
+        __field(uint32_t, len)
+    ),
+    TP_fast_assign(
+        __entry->engine = engine;
+        __entry->len = len;
+    ),
+    TP_printk("engine=%s len=%u", sk_fpga_show_engine(__entry->engine), __entry->len)
+);
+
+// cclks is the number of clocks DONE took to go high
+TRACE_EVENT(sk_fpga_prog_done,
+    TP_PROTO(int cclks, int ret),
+    TP_ARGS(cclks, ret),
+    TP_STRUCT__entry(
+        __field(int, cclks)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->cclks = cclks;
+        __entry->ret = ret;
+    ),
+    TP_printk("cclks=%d ret=%d", __entry->cclks, __entry->ret)
+);
+
+#endif // SK_FPGA_TRACE_H
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fpga-sk-at91sam9m10g45-xc6slx-trace
+#include <trace/define_trace.h>
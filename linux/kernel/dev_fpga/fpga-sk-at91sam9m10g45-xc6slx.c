@@ -1,7 +1,7 @@
 #include "fpga-sk-at91sam9m10g45-xc6slx.h"
 
-#define DEBUG
-
+#define CREATE_TRACE_POINTS
+#include "fpga-sk-at91sam9m10g45-xc6slx-trace.h"
 
 #include <linux/fs.h>
 #include <asm/segment.h>
@@ -10,123 +10,680 @@
 
 struct sk_fpga fpga;
 
+static uint prog_engine = SK_FPGA_PROG_PIO;
+module_param(prog_engine, uint, 0644);
+MODULE_PARM_DESC(prog_engine, "Bitstream loading engine: 0 - gpiolib, 1 - direct PIO writes");
+
+static bool prog_verify;
+module_param(prog_verify, bool, 0644);
+MODULE_PARM_DESC(prog_verify, "Compare PIO engine waveform against gpiolib one before programming");
+
+static int dma_threshold = -1;
+module_param(dma_threshold, int, 0644);
+MODULE_PARM_DESC(dma_threshold, "Data read()/write() size from which dma is used instead of PIO, -1 - measure after programming and SMC timing changes");
+
+static uint irq_poll_mode = SK_FPGA_IRQ_POLL_ADAPTIVE;
+module_param(irq_poll_mode, uint, 0644);
+MODULE_PARM_DESC(irq_poll_mode, "0 - fpga irq only, 1 - poll fpga from hrtimer at high irq rates, 2 - always poll");
+
+static uint irq_poll_enter = 2000;
+module_param(irq_poll_enter, uint, 0644);
+MODULE_PARM_DESC(irq_poll_enter, "Fpga irqs per second from which polling starts");
+
+static uint irq_poll_exit = 500;
+module_param(irq_poll_exit, uint, 0644);
+MODULE_PARM_DESC(irq_poll_exit, "Fpga events per second under which polling stops");
+
+static uint irq_poll_us = 250;
+module_param(irq_poll_us, uint, 0644);
+MODULE_PARM_DESC(irq_poll_us, "Fpga poll period in us");
+
+static uint irq_poll_budget = 8;
+module_param(irq_poll_budget, uint, 0644);
+MODULE_PARM_DESC(irq_poll_budget, "Max status reads and acks per poll");
+
+module_param_named(irq_polling, fpga.irq_polling, bool, 0444);
+MODULE_PARM_DESC(irq_polling, "Fpga irq is masked and polled right now");
+
 static const struct file_operations fpga_fops = {
         .owner          = THIS_MODULE,
         .open           = sk_fpga_open,
         .release        = sk_fpga_close,
-        .write          = sk_fpga_write,
-        .read           = sk_fpga_read,
+        .write_iter     = sk_fpga_write_iter,
+        .read_iter      = sk_fpga_read_iter,
+        .splice_read    = generic_file_splice_read,
+        .splice_write   = iter_file_splice_write,
+        .llseek         = sk_fpga_llseek,
         .unlocked_ioctl = sk_fpga_ioctl,
+        .poll           = sk_fpga_poll,
         .mmap           = sk_fpga_mmap,
 };
 
+#define SK_FPGA_STAT_ATTR(_name, _stat)                                         \
+    static struct sk_fpga_stat_attr sk_fpga_stat_attr_##_name = {               \
+        .attr = __ATTR(_name, 0444, sk_fpga_stat_show, NULL),                   \
+        .stat = _stat,                                                          \
+    }
+
+SK_FPGA_STAT_ATTR(ioctl_ops,         SK_FPGA_STAT_IOCTL_OPS);
+SK_FPGA_STAT_ATTR(ioctl_bytes,       SK_FPGA_STAT_IOCTL_BYTES);
+SK_FPGA_STAT_ATTR(read_ops,          SK_FPGA_STAT_READ_OPS);
+SK_FPGA_STAT_ATTR(read_bytes,        SK_FPGA_STAT_READ_BYTES);
+SK_FPGA_STAT_ATTR(write_ops,         SK_FPGA_STAT_WRITE_OPS);
+SK_FPGA_STAT_ATTR(write_bytes,       SK_FPGA_STAT_WRITE_BYTES);
+SK_FPGA_STAT_ATTR(dma_to_fpga_ops,   SK_FPGA_STAT_DMA_TO_FPGA_OPS);
+SK_FPGA_STAT_ATTR(dma_to_fpga_bytes, SK_FPGA_STAT_DMA_TO_FPGA_BYTES);
+SK_FPGA_STAT_ATTR(dma_to_arm_ops,    SK_FPGA_STAT_DMA_TO_ARM_OPS);
+SK_FPGA_STAT_ATTR(dma_to_arm_bytes,  SK_FPGA_STAT_DMA_TO_ARM_BYTES);
+SK_FPGA_STAT_ATTR(dma_errors,        SK_FPGA_STAT_DMA_ERRORS);
+SK_FPGA_STAT_ATTR(irqs,              SK_FPGA_STAT_IRQS);
+SK_FPGA_STAT_ATTR(prog_runs,         SK_FPGA_STAT_PROG_RUNS);
+SK_FPGA_STAT_ATTR(prog_ns,           SK_FPGA_STAT_PROG_NS);
+SK_FPGA_STAT_ATTR(busy_ns,           SK_FPGA_STAT_BUSY_NS);
+
+static struct attribute* sk_fpga_stat_attrs[] = {
+    &sk_fpga_stat_attr_ioctl_ops.attr.attr,
+    &sk_fpga_stat_attr_ioctl_bytes.attr.attr,
+    &sk_fpga_stat_attr_read_ops.attr.attr,
+    &sk_fpga_stat_attr_read_bytes.attr.attr,
+    &sk_fpga_stat_attr_write_ops.attr.attr,
+    &sk_fpga_stat_attr_write_bytes.attr.attr,
+    &sk_fpga_stat_attr_dma_to_fpga_ops.attr.attr,
+    &sk_fpga_stat_attr_dma_to_fpga_bytes.attr.attr,
+    &sk_fpga_stat_attr_dma_to_arm_ops.attr.attr,
+    &sk_fpga_stat_attr_dma_to_arm_bytes.attr.attr,
+    &sk_fpga_stat_attr_dma_errors.attr.attr,
+    &sk_fpga_stat_attr_irqs.attr.attr,
+    &sk_fpga_stat_attr_prog_runs.attr.attr,
+    &sk_fpga_stat_attr_prog_ns.attr.attr,
+    &sk_fpga_stat_attr_busy_ns.attr.attr,
+    NULL,
+};
+
+// /sys/class/misc/fpga/stats
+static const struct attribute_group sk_fpga_stat_group = {
+    .name  = "stats",
+    .attrs = sk_fpga_stat_attrs,
+};
+
+static const struct attribute_group* sk_fpga_groups[] = {
+    &sk_fpga_stat_group,
+    NULL,
+};
+
 static struct miscdevice sk_fpga_dev = {
-        MISC_DYNAMIC_MINOR,
-        "fpga",
-        &fpga_fops
+        .minor          = MISC_DYNAMIC_MINOR,
+        .name           = "fpga",
+        .fops           = &fpga_fops,
+        .groups         = sk_fpga_groups,
 };
 
 // FIXME: is it optimal way to calculate the pointer?
-uint16_t* sk_fpga_ptr_by_addr (uint32_t addr)
+uint16_t* sk_fpga_ptr_by_addr (enum addr_selector sel, uint32_t addr)
 {
     uint16_t* mem_start = NULL;
     BUG_ON(addr >= fpga.fpga_mem_window_size);
-    BUG_ON(!(fpga.fpga_addr_sel == FPGA_ADDR_CS0) && !(fpga.fpga_addr_sel == FPGA_ADDR_CS1));
-    mem_start = (fpga.fpga_addr_sel == FPGA_ADDR_CS0) ? fpga.fpga_mem_virt_start_cs0 : fpga.fpga_mem_virt_start_cs1;
+    BUG_ON(!(sel == FPGA_ADDR_CS0) && !(sel == FPGA_ADDR_CS1));
+    mem_start = (sel == FPGA_ADDR_CS0) ? fpga.fpga_mem_virt_start_cs0 : fpga.fpga_mem_virt_start_cs1;
     BUG_ON(mem_start == NULL);
     BUG_ON(addr & 0x1);
     return (mem_start + addr/sizeof(uint16_t));
 }
 
+static uint16_t sk_fpga_bus_read (uint16_t* ptr)
+{
+    uint16_t val = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&fpga.bus_lock, flags);
+    val = ioread16(ptr);
+    spin_unlock_irqrestore(&fpga.bus_lock, flags);
+    return val;
+}
+
+static void sk_fpga_bus_write (uint16_t val, uint16_t* ptr)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&fpga.bus_lock, flags);
+    iowrite16(val, ptr);
+    spin_unlock_irqrestore(&fpga.bus_lock, flags);
+}
+
 static int sk_fpga_open (struct inode *inode, struct file *file)
 {
-    if (fpga.opened) 
-    {
-        return -EBUSY;
-    } 
-    else 
+    int i = 0;
+    struct sk_fpga_file* ctx = NULL;
+    // wait for boot programming, nonblocking users poll for readiness instead
+    if (!(file->f_flags & O_NONBLOCK) &&
+        wait_event_interruptible(fpga.prog_wait, !READ_ONCE(fpga.boot_pending)))
+        return -ERESTARTSYS;
+    ctx = kzalloc(sizeof(struct sk_fpga_file), GFP_KERNEL);
+    if (!ctx)
     {
-        fpga.opened++;
+        return -ENOMEM;
     }
+    ctx->mode = SK_FPGA_MODE_DATA;
+    ctx->addr_sel = FPGA_ADDR_UNDEFINED;
+    // irqs happened before open are not reported
+    ctx->irq_seen = atomic_read(&fpga.irq_count);
+    for (i = 0; i < SK_FPGA_IRQ_SOURCES; i++)
+        ctx->irq_src_seen[i] = atomic_read(&fpga.irq_src_count[i]);
+    spin_lock_init(&ctx->dma_lock);
+    atomic_set(&ctx->dma_inflight, 0);
+    init_waitqueue_head(&ctx->dma_wait);
+    mutex_init(&ctx->user_bufs_lock);
+    file->private_data = ctx;
+    atomic_inc(&fpga.opened);
     return 0;
 }
 
 static int sk_fpga_close (struct inode *inode, struct file *file)
 {
-    if (fpga.opened) 
-    {
-        fpga.opened--;
-    } 
-    else 
+    int i = 0;
+    struct sk_fpga_file* ctx = file->private_data;
+    mutex_lock(&fpga.capture_lock);
+    if (fpga.capture_owner == ctx)
+        sk_fpga_capture_stop();
+    mutex_unlock(&fpga.capture_lock);
+    // abandoned programming session still has to give the pins back
+    mutex_lock(&fpga.ctrl_lock);
+    if (fpga.prog_owner == ctx)
+        sk_fpga_prog_session_finish(ctx);
+    mutex_unlock(&fpga.ctrl_lock);
+    // completion callbacks reference the file state, the last one is
+    // done with it once it drops dma_lock
+    wait_event(ctx->dma_wait, !atomic_read(&ctx->dma_inflight));
+    spin_lock_irq(&ctx->dma_lock);
+    spin_unlock_irq(&ctx->dma_lock);
+    for (i = 0; i < SK_FPGA_DMA_USER_BUFS; i++)
     {
-        return -ENODEV;
+        if (ctx->user_bufs[i])
+            sk_fpga_user_buf_release(ctx->user_bufs[i]);
     }
+    atomic_dec(&fpga.opened);
+    kfree(file->private_data);
+    file->private_data = NULL;
     return 0;
 }
 
-// FIXME: sk_fpga_ptr_by_addr doesn't check for window crossing
-static ssize_t sk_fpga_read (struct file *file, char __user *buf,
-                    size_t len, loff_t *ppos)
+// Return number of irq events since the last read, block if there are none.
+// Sources are reported as well if there is room for struct sk_fpga_irq_info
+static ssize_t sk_fpga_read_irq (struct file *file, struct iov_iter *to)
 {
     int i = 0;
-    int res = 0;
-    uint16_t bytes_to_read = (TMP_BUF_SIZE < len) ? TMP_BUF_SIZE : len;
-    uint16_t* start = sk_fpga_ptr_by_addr(fpga.address);
-    // 2 since byte vs short
-    BUG_ON(bytes_to_read & 0x1);
-    BUG_ON((bytes_to_read + fpga.address) > fpga.fpga_mem_window_size);
-    for (; i < bytes_to_read; i += sizeof(uint16_t))
+    int ret = 0;
+    uint32_t cur = 0;
+    uint32_t src = 0;
+    struct sk_fpga_irq_info info = {0};
+    struct sk_fpga_file* ctx = file->private_data;
+
+    if (iov_iter_count(to) < sizeof(uint32_t))
+        return -EINVAL;
+
+    cur = atomic_read(&fpga.irq_count);
+    if (cur == ctx->irq_seen)
+    {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(fpga.irq_wait, atomic_read(&fpga.irq_count) != ctx->irq_seen);
+        if (ret)
+            return ret;
+        cur = atomic_read(&fpga.irq_count);
+    }
+    info.events = cur - ctx->irq_seen;
+    sk_fpga_lat_add(SK_FPGA_LAT_IRQ_READ, ktime_get_ns() - atomic64_read(&fpga.irq_stamp_ns));
+    if (iov_iter_count(to) < sizeof(struct sk_fpga_irq_info))
+    {
+        if (copy_to_iter(&info.events, sizeof(uint32_t), to) != sizeof(uint32_t))
+            return -EFAULT;
+        ctx->irq_seen = cur;
+        return sizeof(uint32_t);
+    }
+    for (i = 0; i < SK_FPGA_IRQ_SOURCES; i++)
     {
-        fpga.fpga_prog_buffer[i] = ioread16(start + i);
+        src = atomic_read(&fpga.irq_src_count[i]);
+        if (src != ctx->irq_src_seen[i])
+            info.sources |= BIT(i);
+        ctx->irq_src_seen[i] = src;
     }
-    res = copy_to_user(buf, fpga.fpga_prog_buffer, bytes_to_read);
-    return (bytes_to_read - res);
+    if (copy_to_iter(&info, sizeof(info), to) != sizeof(info))
+        return -EFAULT;
+    ctx->irq_seen = cur;
+    return sizeof(info);
 }
 
-// Write data to FPGA if FPGA is not being programmed
-static ssize_t sk_fpga_write(struct file *file, const char __user *buf,
-                             size_t len, loff_t *ppos)
+// Period the producer is on is being rewritten by dma, read() skips it
+// together with older ones. capture_idx_lock is held
+static void sk_fpga_capture_skip_busy (void)
 {
-    int i = 0;
-    uint16_t* start = NULL;
-    uint16_t bytes_to_copy = (TMP_BUF_SIZE < len) ? TMP_BUF_SIZE : len;
-    int res = copy_from_user(fpga.fpga_prog_buffer, buf, bytes_to_copy);
-    start = sk_fpga_ptr_by_addr(fpga.address);
-    BUG_ON((bytes_to_copy + fpga.address) > fpga.fpga_mem_window_size);
+    struct sk_fpga_capture_header* hdr = fpga.capture_hdr;
+
+    if (hdr->producer - hdr->consumer < fpga.capture_periods)
+        return;
+    hdr->overruns++;
+    hdr->consumer = hdr->producer - fpga.capture_periods + 1;
+    fpga.capture_read_off = 0;
+}
+
+// Copy captured data out of the ring, block until at least one period is ready
+static ssize_t sk_fpga_read_capture (struct file *file, struct iov_iter *to)
+{
+    int ret = 0;
+    bool ready = false;
+    size_t done = 0;
+    size_t len = iov_iter_count(to);
+    uint32_t chunk = 0;
+    uint32_t copied = 0;
+    uint32_t period = 0;
+    uint32_t consumer = 0;
+    uint32_t off = 0;
+    unsigned long flags;
+    struct sk_fpga_capture_header* hdr = fpga.capture_hdr;
+
+    if (!hdr)
+        return -ENODATA;
+    if (READ_ONCE(hdr->producer) == READ_ONCE(hdr->consumer))
+    {
+        // nothing more to come after capture is stopped
+        if (!READ_ONCE(fpga.capture_running))
+            return 0;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(fpga.capture_wait,
+                                       (READ_ONCE(hdr->producer) != READ_ONCE(hdr->consumer)) ||
+                                       !READ_ONCE(fpga.capture_running));
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&fpga.capture_lock);
+    while (done < len)
+    {
+        // overrun moves consumer and read offset under the index lock
+        spin_lock_irqsave(&fpga.capture_idx_lock, flags);
+        sk_fpga_capture_skip_busy();
+        consumer = hdr->consumer;
+        off = fpga.capture_read_off;
+        ready = (hdr->producer != consumer);
+        spin_unlock_irqrestore(&fpga.capture_idx_lock, flags);
+        if (!ready)
+            break;
+        period = consumer % fpga.capture_periods;
+        chunk = min_t(size_t, len - done, fpga.capture_period_len - off);
+        // straight from the ring into user memory or pipe pages
+        copied = copy_to_iter(fpga.capture_buf + period * fpga.capture_period_len + off, chunk, to);
+
+        spin_lock_irqsave(&fpga.capture_idx_lock, flags);
+        // dma came around to the period during the copy, the copy is torn
+        if ((hdr->consumer != consumer) || (hdr->producer - consumer >= fpga.capture_periods))
+        {
+            spin_unlock_irqrestore(&fpga.capture_idx_lock, flags);
+            iov_iter_revert(to, copied);
+            continue;
+        }
+        fpga.capture_read_off = off + copied;
+        if (fpga.capture_read_off == fpga.capture_period_len)
+        {
+            fpga.capture_read_off = 0;
+            hdr->consumer++;
+        }
+        spin_unlock_irqrestore(&fpga.capture_idx_lock, flags);
+        done += copied;
+        if (copied != chunk)
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&fpga.capture_lock);
+    return done ? done : ret;
+}
+
+static unsigned int sk_fpga_poll (struct file *file, poll_table *wait)
+{
+    unsigned int mask = 0;
+    struct sk_fpga_file* ctx = file->private_data;
+    bool irq_pending = false;
+
+    poll_wait(file, &fpga.irq_wait, wait);
+    poll_wait(file, &ctx->dma_wait, wait);
+    poll_wait(file, &fpga.capture_wait, wait);
+    poll_wait(file, &fpga.prog_wait, wait);
+    irq_pending = (atomic_read(&fpga.irq_count) != ctx->irq_seen);
+
+    switch (ctx->mode)
+    {
+    case SK_FPGA_MODE_IRQ:
+        if (irq_pending)
+            mask |= POLLIN | POLLRDNORM;
+        break;
+    case SK_FPGA_MODE_DMA:
+        if (READ_ONCE(ctx->dma_head) != READ_ONCE(ctx->dma_tail))
+            mask |= POLLIN | POLLRDNORM;
+        if (irq_pending)
+            mask |= POLLPRI;
+        break;
+    case SK_FPGA_MODE_CAPTURE:
+        if (fpga.capture_hdr && (READ_ONCE(fpga.capture_hdr->producer) != READ_ONCE(fpga.capture_hdr->consumer)))
+            mask |= POLLIN | POLLRDNORM;
+        else if (!READ_ONCE(fpga.capture_running))
+            mask |= POLLHUP;
+        if (irq_pending)
+            mask |= POLLPRI;
+        break;
+    case SK_FPGA_MODE_PROG:
+        mask |= POLLOUT | POLLWRNORM;
+        break;
+    default:
+        // fpga memory is accessible once fpga is configured, irqs are reported as priority data
+        if (sk_fpga_ready())
+            mask |= POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+        if (irq_pending)
+            mask |= POLLPRI;
+        break;
+    }
+    return mask;
+}
+
+// Copy words between a window and memory, the address increments unlike with
+// ioread16_rep/iowrite16_rep, which keep accessing a single port
+static void sk_fpga_window_read (uint16_t* dst, uint16_t* src, uint32_t words)
+{
+    uint32_t i = 0;
+    for (i = 0; i < words; i++)
+        dst[i] = readw_relaxed(src + i);
+    rmb();
+}
+
+static void sk_fpga_window_write (uint16_t* dst, const uint16_t* src, uint32_t words)
+{
+    uint32_t i = 0;
+    wmb();
+    for (i = 0; i < words; i++)
+        writew_relaxed(src[i], dst + i);
+}
+
+// Check data access at *ppos and clip it to the window, returns bytes to transfer
+static ssize_t sk_fpga_data_len (struct sk_fpga_file* ctx, size_t len, loff_t pos)
+{
+    if ((ctx->addr_sel != FPGA_ADDR_CS0) && (ctx->addr_sel != FPGA_ADDR_CS1))
+        return -EINVAL;
     // 2 since byte vs short
-    BUG_ON(bytes_to_copy & 0x1);
-    for (; i < bytes_to_copy; i += sizeof(uint16_t))
+    if ((pos & 0x1) || (len & 0x1) || (pos < 0))
+        return -EINVAL;
+    if (pos >= fpga.fpga_mem_window_size)
+        return 0;
+    return min_t(size_t, len, fpga.fpga_mem_window_size - pos);
+}
+
+static void sk_fpga_dma_bounce_done (void* param)
+{
+    complete(param);
+}
+
+// Move len bytes between fpga address addr and bounce_buf, waits for the transfer.
+// dma_chan_lock is held and nothing else is in flight on the channel
+static int sk_fpga_dma_bounce (uint32_t addr, uint32_t len, enum dma_dir dir)
+{
+    struct completion done;
+    struct dma_async_tx_descriptor* dma_desc;
+    dma_cookie_t dma_cookie;
+
+    init_completion(&done);
+    trace_sk_fpga_dma_prep(addr, fpga.bounce_addr_buf, len, dir);
+    dma_desc = dmaengine_prep_dma_memcpy(fpga.fpga_dma_chan,
+                                         (dir == DMA_ARM_TO_FPGA) ? addr : fpga.bounce_addr_buf,
+                                         (dir == DMA_ARM_TO_FPGA) ? fpga.bounce_addr_buf : addr,
+                                         len,
+                                         DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!dma_desc)
+    {
+        sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+        return -EIO;
+    }
+    dma_desc->callback = sk_fpga_dma_bounce_done;
+    dma_desc->callback_param = &done;
+    dma_cookie = dmaengine_submit(dma_desc);
+    if (dma_submit_error(dma_cookie))
     {
-        iowrite16(fpga.fpga_prog_buffer[i], start + i);
+        sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+        return -EIO;
     }
-    return (bytes_to_copy - res);
+    trace_sk_fpga_dma_submit(dma_cookie, len, dir);
+    dma_async_issue_pending(fpga.fpga_dma_chan);
+    if (!wait_for_completion_timeout(&done, msecs_to_jiffies(SK_FPGA_DMA_TIMEOUT_MS)))
+    {
+        printk(KERN_ALERT"Data dma transfer of %u bytes timed out", len);
+        // completion is on stack, callback mustn't run after return.
+        // Channel is exclusive here, only this transfer is dropped
+        dmaengine_terminate_sync(fpga.fpga_dma_chan);
+        trace_sk_fpga_dma_complete(dma_cookie, len, dir, -ETIMEDOUT);
+        sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+        return -ETIMEDOUT;
+    }
+    trace_sk_fpga_dma_complete(dma_cookie, len, dir, 0);
+    // busy time goes to read() or write() this is done for
+    sk_fpga_stat_op(SK_FPGA_STAT_DMA_OPS(dir), len, 0);
+    return 0;
 }
 
-static long sk_fpga_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
+// Data path by the cpu, bus lock is dropped between chunks to keep irq latency bounded
+static ssize_t sk_fpga_data_pio (struct sk_fpga_file* ctx, struct iov_iter* iter, loff_t pos,
+                                 size_t total, enum dma_dir dir)
+{
+    int res = 0;
+    unsigned long flags;
+    size_t done = 0;
+    size_t copied = 0;
+    uint32_t chunk = 0;
+    uint16_t* tmp = NULL;
+
+    // programming buffer is shared, use own one
+    tmp = kmalloc(min_t(size_t, total, TMP_BUF_SIZE), GFP_KERNEL);
+    if (!tmp)
+        return -ENOMEM;
+    while (done < total)
+    {
+        chunk = min_t(size_t, total - done, TMP_BUF_SIZE);
+        if (dir == DMA_ARM_TO_FPGA)
+        {
+            if (copy_from_iter(tmp, chunk, iter) != chunk)
+            {
+                res = -EFAULT;
+                break;
+            }
+            spin_lock_irqsave(&fpga.bus_lock, flags);
+            sk_fpga_window_write(sk_fpga_ptr_by_addr(ctx->addr_sel, pos + done), tmp, chunk / sizeof(uint16_t));
+            spin_unlock_irqrestore(&fpga.bus_lock, flags);
+            done += chunk;
+        }
+        else
+        {
+            spin_lock_irqsave(&fpga.bus_lock, flags);
+            sk_fpga_window_read(tmp, sk_fpga_ptr_by_addr(ctx->addr_sel, pos + done), chunk / sizeof(uint16_t));
+            spin_unlock_irqrestore(&fpga.bus_lock, flags);
+            copied = copy_to_iter(tmp, chunk, iter);
+            done += copied;
+            if (copied != chunk)
+            {
+                res = -EFAULT;
+                break;
+            }
+        }
+        cond_resched();
+    }
+    kfree(tmp);
+    return done ? done : res;
+}
+
+// Same as PIO data path, but chunks of up to DMA_BUF_SIZE go through bounce_buf by dma
+static ssize_t sk_fpga_data_dma (struct sk_fpga_file* ctx, struct iov_iter* iter, loff_t pos,
+                                 size_t total, enum dma_dir dir)
+{
+    int res = 0;
+    ssize_t ret = 0;
+    size_t done = 0;
+    uint32_t chunk = 0;
+    uint32_t base = (ctx->addr_sel == FPGA_ADDR_CS0) ? fpga.fpga_mem_phys_start_cs0 : fpga.fpga_mem_phys_start_cs1;
+    while (done < total)
+    {
+        chunk = min_t(size_t, total - done, DMA_BUF_SIZE);
+        mutex_lock(&fpga.dma_chan_lock);
+        // capture or queued transfers own the channel, the rest goes by PIO
+        if (sk_fpga_dma_chan_busy())
+        {
+            mutex_unlock(&fpga.dma_chan_lock);
+            ret = sk_fpga_data_pio(ctx, iter, pos + done, total - done, dir);
+            if (ret < 0)
+                res = ret;
+            else
+                done += ret;
+            break;
+        }
+        if ((dir == DMA_ARM_TO_FPGA) && (copy_from_iter(fpga.bounce_buf, chunk, iter) != chunk))
+            res = -EFAULT;
+        if (!res)
+            res = sk_fpga_dma_bounce(base + pos + done, chunk, dir);
+        if (!res && (dir == DMA_FPGA_TO_ARM) && (copy_to_iter(fpga.bounce_buf, chunk, iter) != chunk))
+            res = -EFAULT;
+        mutex_unlock(&fpga.dma_chan_lock);
+        if (res)
+            break;
+        done += chunk;
+    }
+    return done ? done : res;
+}
+
+// Small transfers aren't worth dma setup and completion irq, neither is waiting
+// for capture or queued transfers to leave the channel
+static bool sk_fpga_data_use_dma (size_t len)
+{
+    int threshold = READ_ONCE(dma_threshold);
+    return fpga.fpga_dma_chan && (threshold >= 0) && (len >= threshold) && !sk_fpga_dma_chan_busy();
+}
+
+// read(), readv() and splice() to pipes or sockets all end up here
+static ssize_t sk_fpga_read_iter (struct kiocb *iocb, struct iov_iter *to)
+{
+    int res = 0;
+    bool dma = false;
+    s64 start = 0;
+    ssize_t ret = 0;
+    ssize_t total = 0;
+    struct file* file = iocb->ki_filp;
+    loff_t* ppos = &iocb->ki_pos;
+    struct sk_fpga_file* ctx = file->private_data;
+    if (ctx->mode == SK_FPGA_MODE_IRQ)
+    {
+        return sk_fpga_read_irq(file, to);
+    }
+    if (ctx->mode == SK_FPGA_MODE_CAPTURE)
+    {
+        return sk_fpga_read_capture(file, to);
+    }
+    if (ctx->mode == SK_FPGA_MODE_DMA)
+    {
+        res = sk_fpga_dma_reap(ctx, to, iov_iter_count(to) / sizeof(struct sk_fpga_dma_completion), 1,
+                               file->f_flags & O_NONBLOCK);
+        return (res < 0) ? res : res * sizeof(struct sk_fpga_dma_completion);
+    }
+    if (ctx->mode == SK_FPGA_MODE_PROG)
+        return -EINVAL;
+    start = ktime_get_ns();
+    total = sk_fpga_data_len(ctx, iov_iter_count(to), *ppos);
+    if (total <= 0)
+        return total;
+    dma = sk_fpga_data_use_dma(total);
+    if (dma)
+        ret = sk_fpga_data_dma(ctx, to, *ppos, total, DMA_FPGA_TO_ARM);
+    else
+        ret = sk_fpga_data_pio(ctx, to, *ppos, total, DMA_FPGA_TO_ARM);
+    trace_sk_fpga_read(ctx->addr_sel, *ppos, total, ret, dma);
+    sk_fpga_stat_op(SK_FPGA_STAT_READ_OPS, max_t(ssize_t, ret, 0), ktime_get_ns() - start);
+    if (ret > 0)
+        *ppos += ret;
+    return ret;
+}
+
+// Write data to FPGA if FPGA is not being programmed, splice() from pipes included
+static ssize_t sk_fpga_write_iter (struct kiocb *iocb, struct iov_iter *from)
+{
+    bool dma = false;
+    s64 start = 0;
+    ssize_t ret = 0;
+    ssize_t total = 0;
+    size_t len = iov_iter_count(from);
+    loff_t* ppos = &iocb->ki_pos;
+    struct sk_fpga_file* ctx = iocb->ki_filp->private_data;
+    if (ctx->mode == SK_FPGA_MODE_PROG)
+        return sk_fpga_write_prog(ctx, from);
+    start = ktime_get_ns();
+    total = sk_fpga_data_len(ctx, len, *ppos);
+    if (total < 0)
+        return total;
+    if (!total)
+        return len ? -ENOSPC : 0;
+    dma = sk_fpga_data_use_dma(total);
+    if (dma)
+        ret = sk_fpga_data_dma(ctx, from, *ppos, total, DMA_ARM_TO_FPGA);
+    else
+        ret = sk_fpga_data_pio(ctx, from, *ppos, total, DMA_ARM_TO_FPGA);
+    trace_sk_fpga_write(ctx->addr_sel, *ppos, total, ret, dma);
+    sk_fpga_stat_op(SK_FPGA_STAT_WRITE_OPS, max_t(ssize_t, ret, 0), ktime_get_ns() - start);
+    if (ret > 0)
+        *ppos += ret;
+    return ret;
+}
+
+// Data position is an offset inside the selected window
+static loff_t sk_fpga_llseek (struct file *file, loff_t offset, int whence)
+{
+    return fixed_size_llseek(file, offset, whence, fpga.fpga_mem_window_size);
+}
+
+static long sk_fpga_ioctl_cmd (struct file *f, unsigned int cmd, unsigned long arg)
 {
     int ret = 0;
     struct sk_fpga_data data = {0};
     uint8_t value = 0;
-    char fName[256] = {0};
+    char fName[PROG_FILE_NAME_LEN] = {0};
     struct sk_fpga_dma_transaction dma_tran = {0};
+    struct sk_fpga_batch batch = {0};
+    struct sk_fpga_cmd_list cmd_list = {0};
+    struct sk_fpga_dma_request dma_req = {0};
+    struct sk_fpga_dma_reap dma_reap = {0};
+    struct sk_fpga_dma_buf dma_buf = {0};
+    struct sk_fpga_capture_config capture = {0};
+    struct sk_fpga_irq_coalesce coalesce = {0};
+    struct sk_fpga_bitstream bit = {{0}};
+    struct iovec iov;
+    struct iov_iter iter;
+    uint32_t id = 0;
     int pid = 0;
+    s64 start = 0;
+    struct sk_fpga_file* ctx = f->private_data;
 
     switch (cmd)
     {
     // set current fpga ebi timings
     case SKFPGA_IOSSMCTIMINGS:
+        mutex_lock(&fpga.ctrl_lock);
         if (copy_from_user(&fpga.smc_timings, (int __user *)arg, sizeof(struct sk_fpga_smc_timings)))
-            return -EFAULT;
-        if (sk_fpga_setup_smc())
-            return -EFAULT;
+            ret = -EFAULT;
+        else if (sk_fpga_setup_smc())
+            ret = -EFAULT;
+        else
+            sk_fpga_dma_recalibrate();
+        mutex_unlock(&fpga.ctrl_lock);
         break;
 
     // Get current fpga ebi timings
     case SKFPGA_IOGSMCTIMINGS:
+        mutex_lock(&fpga.ctrl_lock);
         if (sk_fpga_read_smc())
-            return -EFAULT;
-        if (copy_to_user((int __user *)arg, &fpga.smc_timings, sizeof(struct sk_fpga_smc_timings)))
-            return -EFAULT;
+            ret = -EFAULT;
+        else if (copy_to_user((int __user *)arg, &fpga.smc_timings, sizeof(struct sk_fpga_smc_timings)))
+            ret = -EFAULT;
+        mutex_unlock(&fpga.ctrl_lock);
         break;
 
     // write short to FPGA
@@ -134,7 +691,12 @@ static long sk_fpga_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
         if (copy_from_user(&data, (int __user *)arg, sizeof(struct sk_fpga_data)))
             return -EFAULT;
         BUG_ON(data.address + sizeof(uint16_t) > fpga.fpga_mem_window_size);
-        iowrite16(data.data, sk_fpga_ptr_by_addr(data.address));
+        if ((ctx->addr_sel != FPGA_ADDR_CS0) && (ctx->addr_sel != FPGA_ADDR_CS1))
+            return -EINVAL;
+        start = ktime_get_ns();
+        sk_fpga_bus_write(data.data, sk_fpga_ptr_by_addr(ctx->addr_sel, data.address));
+        sk_fpga_stat_op(SK_FPGA_STAT_IOCTL_OPS, sizeof(uint16_t), ktime_get_ns() - start);
+        trace_sk_fpga_word(ctx->addr_sel, data.address, data.data, true);
         break;
 
     // read short from FPGA
@@ -142,7 +704,12 @@ static long sk_fpga_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
         if (copy_from_user(&data, (int __user *)arg, sizeof(struct sk_fpga_data)))
             return -EFAULT;
         BUG_ON(data.address + sizeof(uint16_t) > fpga.fpga_mem_window_size);
-        data.data = ioread16(sk_fpga_ptr_by_addr(data.address));
+        if ((ctx->addr_sel != FPGA_ADDR_CS0) && (ctx->addr_sel != FPGA_ADDR_CS1))
+            return -EINVAL;
+        start = ktime_get_ns();
+        data.data = sk_fpga_bus_read(sk_fpga_ptr_by_addr(ctx->addr_sel, data.address));
+        sk_fpga_stat_op(SK_FPGA_STAT_IOCTL_OPS, sizeof(uint16_t), ktime_get_ns() - start);
+        trace_sk_fpga_word(ctx->addr_sel, data.address, data.data, false);
         if (copy_to_user((int __user *)arg, &data, sizeof(struct sk_fpga_data)))
             return -EFAULT;
         break;
@@ -150,116 +717,1161 @@ static long sk_fpga_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
     case SKFPGA_IOSPROG:
         if (copy_from_user(fName, (int __user *)arg, sizeof(char)*PROG_FILE_NAME_LEN))
             return -EFAULT;
-        if (sk_fpga_prog(fName))
+        fName[PROG_FILE_NAME_LEN - 1] = 0;
+        mutex_lock(&fpga.ctrl_lock);
+        if (fpga.prog_owner)
+            ret = -EBUSY;
+        else
+            ret = sk_fpga_prog_file(fName);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSPROGFW:
+        if (copy_from_user(fName, (int __user *)arg, sizeof(char)*PROG_FILE_NAME_LEN))
             return -EFAULT;
+        fName[PROG_FILE_NAME_LEN - 1] = 0;
+        mutex_lock(&fpga.ctrl_lock);
+        if (fpga.prog_owner)
+            ret = -EBUSY;
+        else
+            ret = sk_fpga_prog_fw(fName);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSPROGSTART:
+        mutex_lock(&fpga.ctrl_lock);
+        ret = sk_fpga_prog_session_start(ctx);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSPROGFINISH:
+        mutex_lock(&fpga.ctrl_lock);
+        ret = sk_fpga_prog_session_finish(ctx);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSBITLOAD:
+        if (copy_from_user(&bit, (int __user *)arg, sizeof(struct sk_fpga_bitstream)))
+            return -EFAULT;
+        bit.name[PROG_FILE_NAME_LEN - 1] = 0;
+        mutex_lock(&fpga.ctrl_lock);
+        // loader shares the parser and hash with a write() session
+        if (fpga.prog_owner)
+            ret = -EBUSY;
+        else
+            ret = sk_fpga_bit_cache_load(bit.name, bit.hash);
+        mutex_unlock(&fpga.ctrl_lock);
+        if (ret)
+            return ret;
+        if (copy_to_user((int __user *)arg, &bit, sizeof(struct sk_fpga_bitstream)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSBITSWITCH:
+        if (copy_from_user(&bit, (int __user *)arg, sizeof(struct sk_fpga_bitstream)))
+            return -EFAULT;
+        mutex_lock(&fpga.ctrl_lock);
+        if (fpga.prog_owner)
+            ret = -EBUSY;
+        else
+            ret = sk_fpga_bit_switch(bit.hash);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOGBITLOADED:
+        mutex_lock(&fpga.ctrl_lock);
+        if (fpga.loaded_valid)
+            memcpy(bit.hash, fpga.loaded_hash, SK_FPGA_BIT_HASH_LEN);
+        else
+            ret = -ENODATA;
+        mutex_unlock(&fpga.ctrl_lock);
+        if (ret)
+            return ret;
+        if (copy_to_user((int __user *)arg, &bit, sizeof(struct sk_fpga_bitstream)))
+            return -EFAULT;
+        break;
+
+    // toggle reset ping
+    case SKFPGA_IOSRESET:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
+            return -EFAULT;
+        gpio_set_value(fpga.fpga_pins.fpga_reset, (value) ? 1 : 0);
+        sk_fpga_status_update(0, 0);
+        break;
+
+    case SKFPGA_IOGRESET:
+        value = gpio_get_value(fpga.fpga_pins.fpga_reset);
+        if (copy_to_user((int __user *)arg, &value, sizeof(uint8_t)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSHOSTIRQ:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
+            return -EFAULT;
+        gpio_set_value(fpga.fpga_pins.host_irq, (value) ? 1 : 0);
+        sk_fpga_status_update(0, 0);
         break;
+    
+    case SKFPGA_IOGHOSTIRQ:
+        value = gpio_get_value(fpga.fpga_pins.host_irq);
+        if (copy_to_user((int __user *)arg, &value, sizeof(uint8_t)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSFPGAIRQ:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
+            return -EFAULT;
+        mutex_lock(&fpga.ctrl_lock);
+        // irq is shared by all files, only the first request registers it
+        if (value && !fpga.irq_num)
+        {
+            if (sk_fpga_register_irq())
+                ret = -EFAULT;
+        }
+        else if (!value && fpga.irq_num)
+        {
+            if (sk_fpga_unregister_irq())
+                ret = -EFAULT;
+        }
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSIRQCOALESCE:
+        if (copy_from_user(&coalesce, (void __user *)arg, sizeof(coalesce)))
+            return -EFAULT;
+        mutex_lock(&fpga.ctrl_lock);
+        fpga.irq_coalesce = coalesce;
+        fpga.irq_coalesce_set = true;
+        sk_fpga_irq_coalesce_apply();
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSADDRSEL:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
+            return -EFAULT;
+        if (!(value == FPGA_ADDR_CS0) && !(value == FPGA_ADDR_CS1) && !(value == FPGA_ADDR_DMA) && !(value == FPGA_ADDR_CAPTURE))
+            return -EINVAL;
+        ctx->addr_sel = value;
+        break;
+    
+    case SKFPGA_IOGADDRSEL:
+        value = ctx->addr_sel;
+        if (copy_to_user((int __user *)arg, &value, sizeof(uint8_t)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSDMA:
+        if (copy_from_user(&dma_tran, (int __user *)arg, sizeof(struct sk_fpga_dma_transaction)))
+            return -EFAULT;
+        BUG_ON(dma_tran.addr & 0x1);
+        // dma buffer is shared by all files
+        mutex_lock(&fpga.ctrl_lock);
+        ret = sk_fpga_do_dma_transfer(&dma_tran);
+        mutex_unlock(&fpga.ctrl_lock);
+        break;
+
+    case SKFPGA_IOSPID:
+        if (copy_from_user(&pid, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        fpga.pid = pid;
+        break;
+
+    case SKFPGA_IOSBATCH:
+        if (copy_from_user(&batch, (int __user *)arg, sizeof(struct sk_fpga_batch)))
+            return -EFAULT;
+        ret = sk_fpga_do_batch(ctx, &batch);
+        break;
+
+    case SKFPGA_IOSCMDLIST:
+        if (copy_from_user(&cmd_list, (int __user *)arg, sizeof(struct sk_fpga_cmd_list)))
+            return -EFAULT;
+        ret = sk_fpga_do_cmd_list(ctx, &cmd_list);
+        // report failed command index back in any case
+        if (copy_to_user((int __user *)arg, &cmd_list, sizeof(struct sk_fpga_cmd_list)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSFILEMODE:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
+            return -EFAULT;
+        if (value >= SK_FPGA_MODE_LAST)
+            return -EINVAL;
+        ctx->mode = value;
+        break;
+
+    case SKFPGA_IOSDMASUBMIT:
+        if (copy_from_user(&dma_req, (int __user *)arg, sizeof(struct sk_fpga_dma_request)))
+            return -EFAULT;
+        ret = sk_fpga_dma_submit(ctx, &dma_req);
+        if (ret)
+            return ret;
+        if (copy_to_user((int __user *)arg, &dma_req, sizeof(struct sk_fpga_dma_request)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOGDMACOMPL:
+        if (copy_from_user(&dma_reap, (int __user *)arg, sizeof(struct sk_fpga_dma_reap)))
+            return -EFAULT;
+        dma_reap.max = min_t(uint32_t, dma_reap.max, SK_FPGA_DMA_RING_SIZE);
+        ret = import_single_range(READ, dma_reap.completions,
+                                  dma_reap.max * sizeof(struct sk_fpga_dma_completion), &iov, &iter);
+        if (ret)
+            return ret;
+        ret = sk_fpga_dma_reap(ctx, &iter, dma_reap.max, dma_reap.min,
+                               f->f_flags & O_NONBLOCK);
+        if (ret < 0)
+            return ret;
+        dma_reap.num = ret;
+        ret = 0;
+        if (copy_to_user((int __user *)arg, &dma_reap, sizeof(struct sk_fpga_dma_reap)))
+            return -EFAULT;
+        break;
+
+    case SKFPGA_IOSDMABUFREG:
+        if (copy_from_user(&dma_buf, (int __user *)arg, sizeof(struct sk_fpga_dma_buf)))
+            return -EFAULT;
+        ret = sk_fpga_dma_buf_register(ctx, &dma_buf);
+        if (ret)
+            return ret;
+        if (copy_to_user((int __user *)arg, &dma_buf, sizeof(struct sk_fpga_dma_buf)))
+        {
+            sk_fpga_dma_buf_unregister(ctx, dma_buf.id);
+            return -EFAULT;
+        }
+        break;
+
+    case SKFPGA_IOSDMABUFUNREG:
+        if (copy_from_user(&id, (int __user *)arg, sizeof(uint32_t)))
+            return -EFAULT;
+        ret = sk_fpga_dma_buf_unregister(ctx, id);
+        break;
+
+    case SKFPGA_IOSCAPTURESTART:
+        if (copy_from_user(&capture, (int __user *)arg, sizeof(struct sk_fpga_capture_config)))
+            return -EFAULT;
+        mutex_lock(&fpga.capture_lock);
+        ret = sk_fpga_capture_start(ctx, &capture);
+        mutex_unlock(&fpga.capture_lock);
+        break;
+
+    case SKFPGA_IOSCAPTURESTOP:
+        mutex_lock(&fpga.capture_lock);
+        ret = sk_fpga_capture_stop();
+        mutex_unlock(&fpga.capture_lock);
+        break;
+
+    default:
+        return -ENOTTY;
+    }
+    return ret;
+}
+
+// Commands return from many places, trace them around the dispatch
+static long sk_fpga_ioctl (struct file *f, unsigned int cmd, unsigned long arg)
+{
+    long ret = 0;
+    trace_sk_fpga_ioctl_enter(cmd, arg);
+    ret = sk_fpga_ioctl_cmd(f, cmd, arg);
+    trace_sk_fpga_ioctl_exit(cmd, ret);
+    return ret;
+}
+
+// Run a vector of short reads/writes within a single syscall
+int sk_fpga_do_batch (struct sk_fpga_file* ctx, struct sk_fpga_batch* batch)
+{
+    int i = 0;
+    int ret = 0;
+    unsigned long flags;
+    struct sk_fpga_batch_entry* entries = NULL;
+
+    if (!batch->num)
+        return 0;
+    if (batch->num > SK_FPGA_BATCH_MAX)
+        return -EINVAL;
+    if ((ctx->addr_sel != FPGA_ADDR_CS0) && (ctx->addr_sel != FPGA_ADDR_CS1))
+        return -EINVAL;
+
+    entries = memdup_user(batch->entries, batch->num * sizeof(struct sk_fpga_batch_entry));
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+
+    // validate the whole batch before touching the bus
+    for (i = 0; i < batch->num; i++)
+    {
+        if ((entries[i].address & 0x1) ||
+            (entries[i].address + sizeof(uint16_t) > fpga.fpga_mem_window_size) ||
+            (entries[i].op >= SK_FPGA_OP_LAST))
+        {
+            ret = -EINVAL;
+            goto free_entries;
+        }
+    }
+
+    // batch is not interleaved with accesses from other files
+    spin_lock_irqsave(&fpga.bus_lock, flags);
+    for (i = 0; i < batch->num; i++)
+    {
+        if (entries[i].op == SK_FPGA_OP_WRITE)
+            iowrite16(entries[i].data, sk_fpga_ptr_by_addr(ctx->addr_sel, entries[i].address));
+        else
+            entries[i].data = ioread16(sk_fpga_ptr_by_addr(ctx->addr_sel, entries[i].address));
+    }
+    spin_unlock_irqrestore(&fpga.bus_lock, flags);
+
+    if (copy_to_user(batch->entries, entries, batch->num * sizeof(struct sk_fpga_batch_entry)))
+        ret = -EFAULT;
+
+free_entries:
+    kfree(entries);
+    return ret;
+}
+
+// A list may hold many long delays, a killed caller leaves before the next one
+static int sk_fpga_cmd_delay (uint32_t us)
+{
+    if (!us)
+        return 0;
+    if (us <= SK_FPGA_CMD_SPIN_US)
+    {
+        udelay(us);
+        return 0;
+    }
+    if (fatal_signal_pending(current))
+        return -EINTR;
+    usleep_range(us, us + us / 8);
+    return 0;
+}
+
+// poll address until masked value matches, spin first and sleep between polls later
+static int sk_fpga_cmd_wait (enum addr_selector sel, struct sk_fpga_cmd* cmd, uint16_t* result)
+{
+    ktime_t start = ktime_get();
+    s64 elapsed = 0;
+    uint16_t* ptr = sk_fpga_ptr_by_addr(sel, cmd->address);
+
+    for (;;)
+    {
+        *result = sk_fpga_bus_read(ptr);
+        if ((*result & cmd->mask) == (cmd->data & cmd->mask))
+            return 0;
+        elapsed = ktime_us_delta(ktime_get(), start);
+        if (elapsed >= cmd->arg)
+            return -ETIMEDOUT;
+        if (elapsed < SK_FPGA_CMD_SPIN_US)
+        {
+            cpu_relax();
+        }
+        else
+        {
+            if (fatal_signal_pending(current))
+                return -EINTR;
+            usleep_range(10, 20);
+        }
+    }
+}
+
+static int sk_fpga_check_cmd (struct sk_fpga_file* ctx, struct sk_fpga_cmd* cmd)
+{
+    switch (cmd->op)
+    {
+    case SK_FPGA_CMD_READ:
+    case SK_FPGA_CMD_WRITE:
+    case SK_FPGA_CMD_RMW:
+    case SK_FPGA_CMD_WAIT:
+        if ((cmd->address & 0x1) || (cmd->address + sizeof(uint16_t) > fpga.fpga_mem_window_size))
+            return -EINVAL;
+        if ((ctx->addr_sel != FPGA_ADDR_CS0) && (ctx->addr_sel != FPGA_ADDR_CS1))
+            return -EINVAL;
+        break;
+    case SK_FPGA_CMD_DELAY:
+    case SK_FPGA_CMD_HOST_IRQ:
+    case SK_FPGA_CMD_RESET:
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (cmd->arg > SK_FPGA_CMD_MAX_TIMEOUT_US)
+        return -EINVAL;
+    return 0;
+}
+
+// Run a small program of bus, gpio and delay commands within a single syscall
+int sk_fpga_do_cmd_list (struct sk_fpga_file* ctx, struct sk_fpga_cmd_list* list)
+{
+    int i = 0;
+    int ret = 0;
+    unsigned long flags;
+    uint16_t val = 0;
+    struct sk_fpga_cmd* cmds = NULL;
+    uint16_t* results = NULL;
+
+    list->failed = -1;
+    if (!list->num)
+        return 0;
+    if (list->num > SK_FPGA_CMD_MAX)
+        return -EINVAL;
+
+    cmds = memdup_user(list->cmds, list->num * sizeof(struct sk_fpga_cmd));
+    if (IS_ERR(cmds))
+        return PTR_ERR(cmds);
+
+    results = kcalloc(list->num, sizeof(uint16_t), GFP_KERNEL);
+    if (!results)
+    {
+        ret = -ENOMEM;
+        goto free_cmds;
+    }
+
+    // validate the whole program before touching anything
+    for (i = 0; i < list->num; i++)
+    {
+        ret = sk_fpga_check_cmd(ctx, &cmds[i]);
+        if (ret)
+        {
+            list->failed = i;
+            goto free_results;
+        }
+    }
+
+    for (i = 0; i < list->num; i++)
+    {
+        struct sk_fpga_cmd* cmd = &cmds[i];
+        switch (cmd->op)
+        {
+        case SK_FPGA_CMD_READ:
+            results[i] = sk_fpga_bus_read(sk_fpga_ptr_by_addr(ctx->addr_sel, cmd->address));
+            break;
+        case SK_FPGA_CMD_WRITE:
+            sk_fpga_bus_write(cmd->data, sk_fpga_ptr_by_addr(ctx->addr_sel, cmd->address));
+            break;
+        case SK_FPGA_CMD_RMW:
+            spin_lock_irqsave(&fpga.bus_lock, flags);
+            val = ioread16(sk_fpga_ptr_by_addr(ctx->addr_sel, cmd->address));
+            val = (val & ~cmd->mask) | (cmd->data & cmd->mask);
+            iowrite16(val, sk_fpga_ptr_by_addr(ctx->addr_sel, cmd->address));
+            spin_unlock_irqrestore(&fpga.bus_lock, flags);
+            results[i] = val;
+            break;
+        case SK_FPGA_CMD_WAIT:
+            ret = sk_fpga_cmd_wait(ctx->addr_sel, cmd, &results[i]);
+            break;
+        case SK_FPGA_CMD_DELAY:
+            ret = sk_fpga_cmd_delay(cmd->arg);
+            break;
+        case SK_FPGA_CMD_HOST_IRQ:
+            gpio_set_value(fpga.fpga_pins.host_irq, (cmd->data) ? 1 : 0);
+            sk_fpga_status_update(0, 0);
+            break;
+        case SK_FPGA_CMD_RESET:
+            gpio_set_value(fpga.fpga_pins.fpga_reset, (cmd->data) ? 1 : 0);
+            sk_fpga_status_update(0, 0);
+            break;
+        }
+        if (ret)
+        {
+            list->failed = i;
+            break;
+        }
+    }
+
+    // partial results are returned as well
+    if (list->results && copy_to_user(list->results, results, list->num * sizeof(uint16_t)))
+        ret = -EFAULT;
+
+free_results:
+    kfree(results);
+free_cmds:
+    kfree(cmds);
+    return ret;
+}
+
+// Channel has transfers of another path in flight, a hint without dma_chan_lock
+static bool sk_fpga_dma_chan_busy (void)
+{
+    return READ_ONCE(fpga.capture_running) || atomic_read(&fpga.dma_async_active) ||
+           atomic_read(&fpga.dma_legacy_busy);
+}
+
+// One SKFPGA_IOSDMA transfer is in flight at a time and only while nothing else
+// uses the channel, so a failed one can be terminated without dropping others
+int sk_fpga_do_dma_transfer (struct sk_fpga_dma_transaction* tran)
+{
+    int err = 0;
+    enum dma_status status;
+    struct dma_async_tx_descriptor* dma_desc;
+    dma_cookie_t        dma_cookie;
+
+    mutex_lock(&fpga.dma_chan_lock);
+    if (sk_fpga_dma_chan_busy())
+    {
+        err = -EBUSY;
+        goto unlock;
+    }
+    if (sk_fpga_dma_config_slave())
+    {
+        err = -EFAULT;
+        goto unlock;
+    }
+    trace_sk_fpga_dma_prep(tran->addr, fpga.dma_addr_buf, tran->len, tran->dir);
+    dma_desc = dmaengine_prep_dma_memcpy(fpga.fpga_dma_chan,
+                                         ((enum dma_dir)tran->dir == DMA_ARM_TO_FPGA) ? tran->addr : fpga.dma_addr_buf,
+                                         ((enum dma_dir)tran->dir == DMA_ARM_TO_FPGA) ? fpga.dma_addr_buf : tran->addr,
+                                         tran->len,
+                                         DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!dma_desc)
+    {
+        err = -EIO;
+        goto fail;
+    }
+    dma_desc->callback = (void*)sk_fpga_dma_callback;
+    // callback may run as soon as the descriptor is submitted
+    fpga.dma_submit_tran = *tran;
+    fpga.dma_submit_cookie = atomic_inc_return(&fpga.dma_cookie);
+    fpga.dma_submit_ns = ktime_get_ns();
+    atomic_set(&fpga.dma_legacy_busy, 1);
+    dma_cookie = dmaengine_submit(dma_desc);
+    if (dma_submit_error(dma_cookie))
+    {
+        atomic_set(&fpga.dma_legacy_busy, 0);
+        err = -EIO;
+        goto fail;
+    }
+    trace_sk_fpga_dma_submit(fpga.dma_submit_cookie, tran->len, tran->dir);
+    sk_fpga_status_update(1, 0);
+    dma_async_issue_pending(fpga.fpga_dma_chan);
+    mutex_unlock(&fpga.dma_chan_lock);
+    if (!tran->sync)
+        return 0;
+
+    status = dma_sync_wait(fpga.fpga_dma_chan, dma_cookie);
+    if (status != DMA_COMPLETE)
+    {
+        printk(KERN_ALERT"DMA tranfer failed with status %d", status);
+        // channel is ours while the flag is set, nothing else is dropped here
+        dmaengine_terminate_sync(fpga.fpga_dma_chan);
+        // callback won't run anymore, the transfer is completed as failed here
+        if (atomic_xchg(&fpga.dma_legacy_busy, 0))
+        {
+            trace_sk_fpga_dma_complete(fpga.dma_submit_cookie, tran->len, tran->dir, -EIO);
+            sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+            sk_fpga_status_update(0, 1);
+            return -EIO;
+        }
+    }
+    return 0;
+
+fail:
+    printk(KERN_ALERT"Failed to submit dma transfer");
+    sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+unlock:
+    mutex_unlock(&fpga.dma_chan_lock);
+    return err;
+}
+
+// Post completion to the file's ring once all pieces of the transfer are done
+static void sk_fpga_dma_req_put (struct sk_fpga_dma_req* req)
+{
+    unsigned long flags;
+    struct sk_fpga_file* ctx = req->ctx;
+    struct sk_fpga_dma_completion* c = NULL;
+
+    if (!atomic_dec_and_test(&req->pending))
+        return;
+    sk_fpga_lat_add(SK_FPGA_LAT_DMA_ASYNC, ktime_get_ns() - req->submit_ns);
+    trace_sk_fpga_dma_complete(req->cookie, req->len, req->dir, req->status);
+    if (req->status)
+        sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+    else
+        sk_fpga_stat_op(SK_FPGA_STAT_DMA_OPS(req->dir), req->len, ktime_get_ns() - req->submit_ns);
+    sk_fpga_status_update(0, 1);
+    atomic_dec(&fpga.dma_async_active);
+
+    if (req->buf)
+    {
+        if (req->dir == DMA_FPGA_TO_ARM)
+            sk_fpga_user_buf_sync(req->buf, req->offset, req->len, true);
+        atomic_dec(&req->buf->busy);
+    }
+
+    spin_lock_irqsave(&ctx->dma_lock, flags);
+    // submit reserves a slot for every in-flight transfer, so ring can't overflow
+    c = &ctx->dma_ring[ctx->dma_tail % SK_FPGA_DMA_RING_SIZE];
+    c->cookie = req->cookie;
+    c->status = req->status;
+    ctx->dma_tail++;
+    atomic_dec(&ctx->dma_inflight);
+    // close() frees ctx once it sees no inflight and gets the lock, so wake before unlock
+    wake_up(&ctx->dma_wait);
+    spin_unlock_irqrestore(&ctx->dma_lock, flags);
+
+    kfree(req);
+}
+
+static void sk_fpga_dma_complete (void* param, const struct dmaengine_result* result)
+{
+    struct sk_fpga_dma_req* req = param;
+    if (result && result->result != DMA_TRANS_NOERROR)
+        req->status = -EIO;
+    sk_fpga_dma_req_put(req);
+}
+
+static bool sk_fpga_dma_addr_valid (uint32_t addr, uint32_t len)
+{
+    uint32_t start = 0;
+    if ((addr >= fpga.fpga_mem_phys_start_cs0) &&
+        (addr < fpga.fpga_mem_phys_start_cs0 + fpga.fpga_mem_window_size))
+        start = fpga.fpga_mem_phys_start_cs0;
+    else if ((addr >= fpga.fpga_mem_phys_start_cs1) &&
+             (addr < fpga.fpga_mem_phys_start_cs1 + fpga.fpga_mem_window_size))
+        start = fpga.fpga_mem_phys_start_cs1;
+    else
+        return false;
+    return (addr - start + len <= fpga.fpga_mem_window_size);
+}
+
+// Queue one descriptor of the transfer, its completion is accounted in req
+static int sk_fpga_dma_queue_piece (struct sk_fpga_dma_req* req, dma_addr_t fpga_addr, dma_addr_t mem, size_t len)
+{
+    struct dma_async_tx_descriptor* dma_desc = NULL;
+
+    trace_sk_fpga_dma_prep(fpga_addr, mem, len, req->dir);
+    dma_desc = dmaengine_prep_dma_memcpy(fpga.fpga_dma_chan,
+                                         (req->dir == DMA_ARM_TO_FPGA) ? fpga_addr : mem,
+                                         (req->dir == DMA_ARM_TO_FPGA) ? mem : fpga_addr,
+                                         len,
+                                         DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!dma_desc)
+        return -EIO;
+    dma_desc->callback_result = sk_fpga_dma_complete;
+    dma_desc->callback_param = req;
+    atomic_inc(&req->pending);
+    if (dma_submit_error(dmaengine_submit(dma_desc)))
+    {
+        atomic_dec(&req->pending);
+        return -EIO;
+    }
+    trace_sk_fpga_dma_submit(req->cookie, len, req->dir);
+    return 0;
+}
+
+// Queue transfer without waiting for it, completion goes to the file's ring
+int sk_fpga_dma_submit (struct sk_fpga_file* ctx, struct sk_fpga_dma_request* req)
+{
+    int i = 0;
+    int ret = 0;
+    int queued = 0;
+    unsigned long flags;
+    uint32_t used = 0;
+    uint32_t offset = req->buf_offset;
+    uint32_t left = req->len;
+    uint32_t piece = 0;
+    struct scatterlist* sg = NULL;
+    struct sk_fpga_user_buf* ub = NULL;
+    struct sk_fpga_dma_req* dreq = NULL;
+
+    if (!req->len || (req->len & 0x1) || (req->addr & 0x1) || (req->buf_offset & 0x1))
+        return -EINVAL;
+    if ((req->dir != DMA_ARM_TO_FPGA) && (req->dir != DMA_FPGA_TO_ARM))
+        return -EINVAL;
+    if (!sk_fpga_dma_addr_valid(req->addr, req->len))
+        return -EINVAL;
+
+    if (req->buf_id)
+    {
+        ub = sk_fpga_user_buf_get(ctx, req->buf_id);
+        if (!ub)
+            return -ENOENT;
+        if ((req->buf_offset > ub->len) || (req->len > ub->len - req->buf_offset))
+        {
+            atomic_dec(&ub->busy);
+            return -EINVAL;
+        }
+    }
+    else if ((req->buf_offset > DMA_BUF_SIZE) || (req->len > DMA_BUF_SIZE - req->buf_offset))
+    {
+        return -EINVAL;
+    }
+
+    dreq = kzalloc(sizeof(struct sk_fpga_dma_req), GFP_KERNEL);
+    if (!dreq)
+    {
+        ret = -ENOMEM;
+        goto put_buf;
+    }
+    dreq->ctx = ctx;
+    dreq->buf = ub;
+    dreq->offset = req->buf_offset;
+    dreq->len = req->len;
+    dreq->dir = req->dir;
+    // submit holds a reference till all pieces are queued
+    atomic_set(&dreq->pending, 1);
+
+    // reserve a ring slot for the completion
+    spin_lock_irqsave(&ctx->dma_lock, flags);
+    used = ctx->dma_tail - ctx->dma_head + atomic_read(&ctx->dma_inflight);
+    if (used >= SK_FPGA_DMA_RING_SIZE)
+    {
+        spin_unlock_irqrestore(&ctx->dma_lock, flags);
+        ret = -EAGAIN;
+        goto free_req;
+    }
+    atomic_inc(&ctx->dma_inflight);
+    spin_unlock_irqrestore(&ctx->dma_lock, flags);
+
+    mutex_lock(&fpga.dma_chan_lock);
+    // cyclic capture and SKFPGA_IOSDMA own the channel while they run
+    if (READ_ONCE(fpga.capture_running) || atomic_read(&fpga.dma_legacy_busy))
+    {
+        ret = -EBUSY;
+        goto unlock;
+    }
+    if (sk_fpga_dma_config_slave())
+    {
+        ret = -EIO;
+        goto unreserve;
+    }
+
+    // pieces may complete while the rest are queued
+    atomic_inc(&fpga.dma_async_active);
+    dreq->cookie = atomic_inc_return(&fpga.dma_cookie);
+    if (!ub)
+    {
+        if (!sk_fpga_dma_queue_piece(dreq, req->addr, fpga.dma_addr_buf + req->buf_offset, req->len))
+            queued++;
+    }
+    else
+    {
+        // user pages are transferred in place, one descriptor per mapped segment
+        sk_fpga_user_buf_sync(ub, req->buf_offset, req->len, false);
+        for_each_sg(ub->sgt.sgl, sg, ub->nents, i)
+        {
+            if (!left)
+                break;
+            if (offset >= sg_dma_len(sg))
+            {
+                offset -= sg_dma_len(sg);
+                continue;
+            }
+            piece = min_t(uint32_t, sg_dma_len(sg) - offset, left);
+            if (sk_fpga_dma_queue_piece(dreq, req->addr + (req->len - left), sg_dma_address(sg) + offset, piece))
+            {
+                // already queued pieces will report the failure
+                dreq->status = -EIO;
+                break;
+            }
+            queued++;
+            offset = 0;
+            left -= piece;
+        }
+    }
+
+    if (!queued)
+    {
+        atomic_dec(&fpga.dma_async_active);
+        ret = -EIO;
+        goto unreserve;
+    }
+    dreq->submit_ns = ktime_get_ns();
+    sk_fpga_status_update(1, 0);
+    dma_async_issue_pending(fpga.fpga_dma_chan);
+    mutex_unlock(&fpga.dma_chan_lock);
+    req->cookie = dreq->cookie;
+    sk_fpga_dma_req_put(dreq);
+    return 0;
+
+unreserve:
+    printk(KERN_ALERT"Failed to submit dma transfer");
+    sk_fpga_stat_add(SK_FPGA_STAT_DMA_ERRORS, 1);
+unlock:
+    mutex_unlock(&fpga.dma_chan_lock);
+    atomic_dec(&ctx->dma_inflight);
+    wake_up(&ctx->dma_wait);
+free_req:
+    kfree(dreq);
+put_buf:
+    if (ub)
+        atomic_dec(&ub->busy);
+    return ret;
+}
+
+// Sync cpu/device view of [offset, offset + len) of the user buffer,
+// direction has to match the one buffer is mapped with
+static void sk_fpga_user_buf_sync (struct sk_fpga_user_buf* ub, uint32_t offset, uint32_t len, bool for_cpu)
+{
+    int i = 0;
+    uint32_t piece = 0;
+    struct scatterlist* sg = NULL;
+    struct device* dev = &fpga.pdev->dev;
+
+    for_each_sg(ub->sgt.sgl, sg, ub->nents, i)
+    {
+        if (!len)
+            break;
+        if (offset >= sg_dma_len(sg))
+        {
+            offset -= sg_dma_len(sg);
+            continue;
+        }
+        piece = min_t(uint32_t, sg_dma_len(sg) - offset, len);
+        if (for_cpu)
+            dma_sync_single_range_for_cpu(dev, sg_dma_address(sg), offset, piece, DMA_BIDIRECTIONAL);
+        else
+            dma_sync_single_range_for_device(dev, sg_dma_address(sg), offset, piece, DMA_BIDIRECTIONAL);
+        offset = 0;
+        len -= piece;
+    }
+}
+
+// Look buffer up by id and mark it busy, caller drops busy when done
+static struct sk_fpga_user_buf* sk_fpga_user_buf_get (struct sk_fpga_file* ctx, uint32_t id)
+{
+    struct sk_fpga_user_buf* ub = NULL;
+    if (!id || id > SK_FPGA_DMA_USER_BUFS)
+        return NULL;
+    mutex_lock(&ctx->user_bufs_lock);
+    ub = ctx->user_bufs[id - 1];
+    if (ub)
+        atomic_inc(&ub->busy);
+    mutex_unlock(&ctx->user_bufs_lock);
+    return ub;
+}
+
+static void sk_fpga_user_buf_release (struct sk_fpga_user_buf* ub)
+{
+    int i = 0;
+    dma_unmap_sg(&fpga.pdev->dev, ub->sgt.sgl, ub->sgt.orig_nents, DMA_BIDIRECTIONAL);
+    sg_free_table(&ub->sgt);
+    for (i = 0; i < ub->npages; i++)
+    {
+        set_page_dirty_lock(ub->pages[i]);
+        put_page(ub->pages[i]);
+    }
+    kvfree(ub->pages);
+    kfree(ub);
+}
+
+// Pin user memory and map it for DMA once, so it can be used by many transfers
+int sk_fpga_dma_buf_register (struct sk_fpga_file* ctx, struct sk_fpga_dma_buf* reg)
+{
+    int i = 0;
+    int ret = 0;
+    int pinned = 0;
+    unsigned long uaddr = (unsigned long)reg->addr;
+    struct sk_fpga_user_buf* ub = NULL;
+
+    if (!reg->len || (reg->len > SK_FPGA_DMA_USER_BUF_MAX) || (uaddr & 0x1) || (reg->len & 0x1))
+        return -EINVAL;
+
+    ub = kzalloc(sizeof(struct sk_fpga_user_buf), GFP_KERNEL);
+    if (!ub)
+        return -ENOMEM;
+    ub->len = reg->len;
+    atomic_set(&ub->busy, 0);
+    ub->npages = ((uaddr + reg->len - 1) >> PAGE_SHIFT) - (uaddr >> PAGE_SHIFT) + 1;
+    ub->pages = kvmalloc_array(ub->npages, sizeof(struct page*), GFP_KERNEL);
+    if (!ub->pages)
+    {
+        ret = -ENOMEM;
+        goto free_buf;
+    }
+
+    pinned = get_user_pages_fast(uaddr & PAGE_MASK, ub->npages, 1, ub->pages);
+    if (pinned != ub->npages)
+    {
+        ret = -EFAULT;
+        goto unpin;
+    }
+
+    ret = sg_alloc_table_from_pages(&ub->sgt, ub->pages, ub->npages, offset_in_page(uaddr), reg->len, GFP_KERNEL);
+    if (ret)
+        goto unpin;
+
+    ub->nents = dma_map_sg(&fpga.pdev->dev, ub->sgt.sgl, ub->sgt.orig_nents, DMA_BIDIRECTIONAL);
+    if (!ub->nents)
+    {
+        ret = -EIO;
+        goto free_table;
+    }
+
+    mutex_lock(&ctx->user_bufs_lock);
+    for (i = 0; i < SK_FPGA_DMA_USER_BUFS; i++)
+    {
+        if (!ctx->user_bufs[i])
+        {
+            ctx->user_bufs[i] = ub;
+            reg->id = i + 1;
+            break;
+        }
+    }
+    mutex_unlock(&ctx->user_bufs_lock);
+    if (i == SK_FPGA_DMA_USER_BUFS)
+    {
+        sk_fpga_user_buf_release(ub);
+        return -ENOSPC;
+    }
+    return 0;
+
+free_table:
+    sg_free_table(&ub->sgt);
+unpin:
+    for (i = 0; i < pinned; i++)
+    {
+        put_page(ub->pages[i]);
+    }
+    kvfree(ub->pages);
+free_buf:
+    kfree(ub);
+    return ret;
+}
 
-    // toggle reset ping
-    case SKFPGA_IOSRESET:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
-            return -EFAULT;
-        gpio_set_value(fpga.fpga_pins.fpga_reset, (value) ? 1 : 0);
-        break;
+int sk_fpga_dma_buf_unregister (struct sk_fpga_file* ctx, uint32_t id)
+{
+    struct sk_fpga_user_buf* ub = NULL;
+    if (!id || id > SK_FPGA_DMA_USER_BUFS)
+        return -ENOENT;
+    mutex_lock(&ctx->user_bufs_lock);
+    ub = ctx->user_bufs[id - 1];
+    if (!ub || atomic_read(&ub->busy))
+    {
+        mutex_unlock(&ctx->user_bufs_lock);
+        return ub ? -EBUSY : -ENOENT;
+    }
+    ctx->user_bufs[id - 1] = NULL;
+    mutex_unlock(&ctx->user_bufs_lock);
+    sk_fpga_user_buf_release(ub);
+    return 0;
+}
 
-    case SKFPGA_IOGRESET:
-        value = gpio_get_value(fpga.fpga_pins.fpga_reset);
-        if (copy_to_user((int __user *)arg, &value, sizeof(uint8_t)))
-            return -EFAULT;
-        break;
+// min completions are ready or will never be, since not enough transfers are in flight
+static bool sk_fpga_dma_ready (struct sk_fpga_file* ctx, uint32_t min)
+{
+    uint32_t ready = READ_ONCE(ctx->dma_tail) - READ_ONCE(ctx->dma_head);
+    return (ready >= min) || (ready + atomic_read(&ctx->dma_inflight) < min);
+}
 
-    case SKFPGA_IOSHOSTIRQ:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
-            return -EFAULT;
-        gpio_set_value(fpga.fpga_pins.host_irq, (value) ? 1 : 0);
-        break;
-    
-    case SKFPGA_IOGHOSTIRQ:
-        value = gpio_get_value(fpga.fpga_pins.host_irq);
-        if (copy_to_user((int __user *)arg, &value, sizeof(uint8_t)))
-            return -EFAULT;
-        break;
+// Copy up to max completions to user, block until at least min of them are ready
+int sk_fpga_dma_reap (struct sk_fpga_file* ctx, struct iov_iter* to,
+                      uint32_t max, uint32_t min, bool nonblock)
+{
+    int i = 0;
+    int ret = 0;
+    uint32_t num = 0;
+    unsigned long flags;
+    struct sk_fpga_dma_completion done[SK_FPGA_DMA_RING_SIZE];
 
-    case SKFPGA_IOSFPGAIRQ:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
-            return -EFAULT;
-        if (value)
-        {
-            if (sk_fpga_register_irq())
-                return -EFAULT;
-        }
-        else
-        {
-            if (sk_fpga_unregister_irq())
-                return -EFAULT;
-        }
-        break;
+    if (max > SK_FPGA_DMA_RING_SIZE)
+        max = SK_FPGA_DMA_RING_SIZE;
+    if (min > max)
+        return -EINVAL;
 
-    case SKFPGA_IOSADDRSEL:
-        if (copy_from_user(&value, (int __user *)arg, sizeof(uint8_t)))
-            return -EFAULT;
-        BUG_ON(!(value == FPGA_ADDR_CS0) && !(value == FPGA_ADDR_CS1) && !(value == FPGA_ADDR_DMA));
-        fpga.fpga_addr_sel = value;
-        break;
-    
-    case SKFPGA_IOGADDRSEL:
-        if (copy_to_user((int __user *)arg, &fpga.fpga_addr_sel, sizeof(uint8_t)))
-            return -EFAULT;
-        break;
+    if (!sk_fpga_dma_ready(ctx, min))
+    {
+        if (nonblock)
+            return -EAGAIN;
+        ret = wait_event_interruptible(ctx->dma_wait, sk_fpga_dma_ready(ctx, min));
+        if (ret)
+            return ret;
+    }
+
+    spin_lock_irqsave(&ctx->dma_lock, flags);
+    num = ctx->dma_tail - ctx->dma_head;
+    if (num > max)
+        num = max;
+    for (i = 0; i < num; i++)
+    {
+        done[i] = ctx->dma_ring[(ctx->dma_head + i) % SK_FPGA_DMA_RING_SIZE];
+    }
+    ctx->dma_head += num;
+    spin_unlock_irqrestore(&ctx->dma_lock, flags);
 
-    case SKFPGA_IOSDMA:
-        if (copy_from_user(&dma_tran, (int __user *)arg, sizeof(struct sk_fpga_dma_transaction)))
-            return -EFAULT;
-        BUG_ON(dma_tran.addr & 0x1);
-        if (sk_fpga_dma_config_slave())
-            return -EFAULT;
-        if (sk_fpga_do_dma_transfer(&dma_tran))
-            return -EIO;
-        break;
+    if (!num && min && nonblock)
+        return -EAGAIN;
+    if (num && (copy_to_iter(done, num * sizeof(struct sk_fpga_dma_completion), to) !=
+                num * sizeof(struct sk_fpga_dma_completion)))
+        return -EFAULT;
+    return num;
+}
 
-    case SKFPGA_IOSPID:
-        if (copy_from_user(&pid, (int __user *)arg, sizeof(int)))
-            return -EFAULT;
-        fpga.pid = pid;
-        break;
+static void sk_fpga_capture_period (void* param)
+{
+    unsigned long flags;
+    struct sk_fpga_capture_header* hdr = fpga.capture_hdr;
 
-    default:
-        return -ENOTTY;
+    spin_lock_irqsave(&fpga.capture_idx_lock, flags);
+    hdr->producer++;
+    // oldest period got overwritten, consumer index written by user is not trusted either
+    if (hdr->producer - READ_ONCE(hdr->consumer) > fpga.capture_periods)
+    {
+        hdr->overruns++;
+        hdr->consumer = hdr->producer - fpga.capture_periods;
+        fpga.capture_read_off = 0;
     }
+    spin_unlock_irqrestore(&fpga.capture_idx_lock, flags);
+    wake_up_interruptible(&fpga.capture_wait);
+}
+
+// Start cyclic DMA from the fpga data port into the capture ring, capture_lock is held
+int sk_fpga_capture_start (struct sk_fpga_file* ctx, struct sk_fpga_capture_config* cfg)
+{
+    int ret = 0;
+
+    mutex_lock(&fpga.dma_chan_lock);
+    // channel is reconfigured, nothing else may be queued on it
+    if (sk_fpga_dma_chan_busy())
+        ret = -EBUSY;
+    else
+        ret = sk_fpga_capture_setup(ctx, cfg);
+    mutex_unlock(&fpga.dma_chan_lock);
     return ret;
 }
 
-int sk_fpga_do_dma_transfer (struct sk_fpga_dma_transaction* tran)
+// Set up the ring and queue the cyclic transfer, dma_chan_lock is held
+static int sk_fpga_capture_setup (struct sk_fpga_file* ctx, struct sk_fpga_capture_config* cfg)
 {
-    int err = 0;
-    enum dma_status status;
-    struct dma_async_tx_descriptor* dma_desc;
-    dma_cookie_t        dma_cookie;
-    
-    dma_desc = dmaengine_prep_dma_memcpy(fpga.fpga_dma_chan,
-                                         ((enum dma_dir)tran->dir == DMA_ARM_TO_FPGA) ? tran->addr : fpga.dma_addr_buf,
-                                         ((enum dma_dir)tran->dir == DMA_ARM_TO_FPGA) ? fpga.dma_addr_buf : tran->addr,
-                                         tran->len,
-                                         DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    uint32_t size = 0;
+    struct dma_slave_config slave_config = {0};
+    struct dma_async_tx_descriptor* dma_desc = NULL;
+    struct device* dev = &fpga.pdev->dev;
+
+    if (!cfg->period_len || (cfg->period_len & 0x1) || (cfg->periods < 2) || (cfg->addr & 0x1))
+        return -EINVAL;
+    if (cfg->period_len > SK_FPGA_CAPTURE_MAX / cfg->periods)
+        return -EINVAL;
+    if (!sk_fpga_dma_addr_valid(cfg->addr, sizeof(uint16_t)))
+        return -EINVAL;
+    size = PAGE_ALIGN(cfg->period_len * cfg->periods);
+
+    if (!fpga.capture_hdr)
+    {
+        fpga.capture_hdr = (struct sk_fpga_capture_header*)get_zeroed_page(GFP_KERNEL);
+        if (!fpga.capture_hdr)
+            return -ENOMEM;
+    }
 
-    // register callback only in case of async transfer?
-    dma_desc->callback = (void*)sk_fpga_dma_callback;
-    dma_cookie = dmaengine_submit(dma_desc);
-    if (dma_submit_error(dma_cookie))
+    // ring can't be reallocated while somebody has it mapped
+    if (fpga.capture_buf && (fpga.capture_size != size))
     {
-        printk(KERN_ALERT"Failed to submit dma transfer");
-        BUG_ON(1);
+        if (atomic_read(&fpga.capture_maps))
+            return -EBUSY;
+        dma_free_coherent(dev, fpga.capture_size, fpga.capture_buf, fpga.capture_addr_buf);
+        fpga.capture_buf = NULL;
+    }
+    if (!fpga.capture_buf)
+    {
+        fpga.capture_buf = dma_alloc_coherent(dev, size, &fpga.capture_addr_buf, GFP_KERNEL);
+        if (!fpga.capture_buf)
+            return -ENOMEM;
+        fpga.capture_size = size;
+    }
+
+    fpga.capture_period_len = cfg->period_len;
+    fpga.capture_periods = cfg->periods;
+    fpga.capture_read_off = 0;
+    fpga.capture_hdr->producer = 0;
+    fpga.capture_hdr->consumer = 0;
+    fpga.capture_hdr->overruns = 0;
+    fpga.capture_hdr->period_len = cfg->period_len;
+    fpga.capture_hdr->periods = cfg->periods;
+
+    // data port is read as a fifo, every beat comes from the same address
+    slave_config.direction = DMA_DEV_TO_MEM;
+    slave_config.src_addr = cfg->addr;
+    slave_config.src_addr_width = DMA_SLAVE_BUSWIDTH_2_BYTES;
+    slave_config.dst_addr_width = DMA_SLAVE_BUSWIDTH_2_BYTES;
+    slave_config.src_maxburst = 1;
+    slave_config.dst_maxburst = 1;
+    slave_config.device_fc = false;
+    if (dmaengine_slave_config(fpga.fpga_dma_chan, &slave_config))
+        return -EINVAL;
+
+    dma_desc = dmaengine_prep_dma_cyclic(fpga.fpga_dma_chan, fpga.capture_addr_buf,
+                                         cfg->period_len * cfg->periods, cfg->period_len,
+                                         DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!dma_desc)
+    {
+        printk(KERN_ALERT"Failed to prepare cyclic dma transfer");
+        return -EIO;
     }
+    dma_desc->callback = sk_fpga_capture_period;
+    dma_desc->callback_param = NULL;
+    if (dma_submit_error(dmaengine_submit(dma_desc)))
+        return -EIO;
+
+    fpga.capture_owner = ctx;
+    WRITE_ONCE(fpga.capture_running, true);
+    fpga.capture_hdr->running = 1;
     dma_async_issue_pending(fpga.fpga_dma_chan);
-    if (tran->sync)
+    return 0;
+}
+
+// Stop cyclic DMA, the ring stays allocated for readers, capture_lock is held
+int sk_fpga_capture_stop (void)
+{
+    if (!fpga.capture_running)
+        return 0;
+    mutex_lock(&fpga.dma_chan_lock);
+    dmaengine_terminate_sync(fpga.fpga_dma_chan);
+    WRITE_ONCE(fpga.capture_running, false);
+    mutex_unlock(&fpga.dma_chan_lock);
+    fpga.capture_hdr->running = 0;
+    fpga.capture_owner = NULL;
+    // let blocked readers see the end of the stream
+    wake_up_interruptible(&fpga.capture_wait);
+    return 0;
+}
+
+static void sk_fpga_capture_vma_open (struct vm_area_struct* vma)
+{
+    atomic_inc(&fpga.capture_maps);
+}
+
+static void sk_fpga_capture_vma_close (struct vm_area_struct* vma)
+{
+    atomic_dec(&fpga.capture_maps);
+}
+
+static const struct vm_operations_struct sk_fpga_capture_vm_ops = {
+    .open  = sk_fpga_capture_vma_open,
+    .close = sk_fpga_capture_vma_close,
+};
+
+// Map header page followed by the capture ring
+static int sk_fpga_mmap_capture (struct vm_area_struct* vma, unsigned long off)
+{
+    int ret = 0;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long addr = vma->vm_start;
+
+    mutex_lock(&fpga.capture_lock);
+    if (!fpga.capture_hdr || !fpga.capture_buf || (off + len > PAGE_SIZE + fpga.capture_size))
     {
-        status = dma_wait_for_async_tx(dma_desc);
-        if (status != DMA_COMPLETE)
-        {
-            printk(KERN_ALERT"DMA tranfer failed with status %d", status);
-            dmaengine_terminate_async(fpga.fpga_dma_chan);
-        }
+        ret = -EINVAL;
+        goto unlock;
     }
-    return err;
+    if (!off)
+    {
+        ret = remap_pfn_range(vma, addr, virt_to_phys(fpga.capture_hdr) >> PAGE_SHIFT,
+                              PAGE_SIZE, vma->vm_page_prot);
+        if (ret)
+            goto unlock;
+        addr += PAGE_SIZE;
+        len -= PAGE_SIZE;
+        off = PAGE_SIZE;
+    }
+    if (len)
+    {
+        // ring is coherent memory, keep user mapping uncached as well
+        ret = remap_pfn_range(vma, addr, (fpga.capture_addr_buf + off - PAGE_SIZE) >> PAGE_SHIFT,
+                              len, pgprot_writecombine(vma->vm_page_prot));
+        if (ret)
+            goto unlock;
+    }
+    vma->vm_ops = &sk_fpga_capture_vm_ops;
+    sk_fpga_capture_vma_open(vma);
+
+unlock:
+    mutex_unlock(&fpga.capture_lock);
+    return ret;
 }
 
 // TODO: fix dtb to avoid such hacks
@@ -332,22 +1944,51 @@ int sk_fpga_register_irq (void)
         printk(KERN_ALERT"Failed to obtain irq number");
         return -EFAULT;
     }
-    ret = request_irq(fpga.irq_num,
-                      (irq_handler_t)sk_fpga_irq_handler,
-                      IRQ_TYPE_EDGE_BOTH,
-                      "sk_fpga_irq",
-                      NULL);
+    // pio controller of this soc triggers on both edges only
+    fpga.irq_polling = false;
+    fpga.irq_rate_start = ktime_get_ns();
+    fpga.irq_rate_num = 0;
+    ret = request_threaded_irq(fpga.irq_num,
+                               sk_fpga_irq_handler,
+                               sk_fpga_irq_thread,
+                               IRQ_TYPE_EDGE_BOTH | IRQF_ONESHOT,
+                               "sk_fpga_irq",
+                               NULL);
     if (ret)
     {
         printk(KERN_ALERT"Failed to register irq");
         fpga.irq_num = 0;
         return ret;
     }
+    if (READ_ONCE(irq_poll_mode) == SK_FPGA_IRQ_POLL_ALWAYS)
+        sk_fpga_irq_poll_start();
     return ret;
 }
 
+// Write coalescing settings to fpga, they're lost when it's programmed
+// Coalescing registers are the simple_debug ones at the start of cs0
+static void sk_fpga_irq_coalesce_apply (void)
+{
+    unsigned long flags;
+    uint64_t ticks = 0;
+    if (fpga.irq_coalesce.time_us)
+    {
+        ticks = div_u64((uint64_t)fpga.irq_coalesce.time_us * fpga.fpga_freq, USEC_PER_SEC) >> SK_FPGA_IRQ_TIME_SHIFT;
+        ticks = clamp_t(uint64_t, ticks, 1, U16_MAX);
+    }
+    spin_lock_irqsave(&fpga.bus_lock, flags);
+    iowrite16(fpga.irq_coalesce.count, sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_COUNT));
+    iowrite16(ticks, sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_TIME));
+    spin_unlock_irqrestore(&fpga.bus_lock, flags);
+}
+
 int sk_fpga_unregister_irq (void)
 {
+    // waits for the thread, so nothing starts polling anymore,
+    // depth is reset by the next request_threaded_irq()
+    disable_irq(fpga.irq_num);
+    hrtimer_cancel(&fpga.irq_poll_timer);
+    WRITE_ONCE(fpga.irq_polling, false);
     free_irq(fpga.irq_num, NULL);
     fpga.irq_num = 0;
     return 0;
@@ -355,38 +1996,335 @@ int sk_fpga_unregister_irq (void)
 
 irqreturn_t sk_fpga_irq_handler (int irq, void *dev_id)
 {
-    int ret = 0;
+    int level = gpio_get_value(fpga.fpga_pins.fpga_irq);
+    trace_sk_fpga_irq(irq, level);
+    // falling edge, irq line drops once the thread acks the events
+    if (!level)
+        return IRQ_HANDLED;
+    sk_fpga_stat_add(SK_FPGA_STAT_IRQS, 1);
+    fpga.irq_edge_ns = ktime_get_ns();
+    return IRQ_WAKE_THREAD;
+}
 
-    struct task_struct* current_task = NULL;
-    struct siginfo info;
+// Ack all pending sources at once, a batch of events ends up in a single wakeup
+static irqreturn_t sk_fpga_irq_thread (int irq, void *dev_id)
+{
+    s64 rate = 0;
+    uint32_t total = 0;
+
+    sk_fpga_lat_add(SK_FPGA_LAT_IRQ_THREAD, ktime_get_ns() - fpga.irq_edge_ns);
+    total = sk_fpga_irq_ack(UINT_MAX);
+    if (!total)
+        return IRQ_NONE;
+    // readers and pollers pick the events up from the counter
+    atomic64_set(&fpga.irq_stamp_ns, fpga.irq_edge_ns);
+    atomic_add(total, &fpga.irq_count);
+    sk_fpga_status_update(0, 0);
+    wake_up_interruptible(&fpga.irq_wait);
+
+    switch (READ_ONCE(irq_poll_mode))
+    {
+    case SK_FPGA_IRQ_POLL_ADAPTIVE:
+        rate = sk_fpga_irq_rate(1);
+        if (READ_ONCE(irq_poll_enter) && (rate >= READ_ONCE(irq_poll_enter)))
+            sk_fpga_irq_poll_start();
+        break;
+    case SK_FPGA_IRQ_POLL_ALWAYS:
+        sk_fpga_irq_poll_start();
+        break;
+    default:
+        break;
+    }
+    return IRQ_HANDLED;
+}
 
-    // for some reason irq happens right after registering
-    if (!gpio_get_value(fpga.fpga_pins.fpga_irq))
-        return IRQ_HANDLED;
+// Read and ack pending events while irq line is high, up to budget times,
+// returns number of events
+static uint32_t sk_fpga_irq_ack (uint32_t budget)
+{
+    int i = 0;
+    unsigned long flags;
+    uint16_t status = 0;
+    uint16_t events = 0;
+    uint32_t total = 0;
+    do
+    {
+        spin_lock_irqsave(&fpga.bus_lock, flags);
+        status = ioread16(sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_STATUS));
+        events = ioread16(sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_EVENTS));
+        // events coming meanwhile stay pending since the read count is subtracted
+        iowrite16(events, sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_EVENTS));
+        iowrite16(status, sk_fpga_ptr_by_addr(FPGA_ADDR_CS0, SK_FPGA_REG_IRQ_STATUS));
+        spin_unlock_irqrestore(&fpga.bus_lock, flags);
+        trace_sk_fpga_irq_ack(status, events, READ_ONCE(fpga.irq_polling));
+        for (i = 0; i < SK_FPGA_IRQ_SOURCES; i++)
+        {
+            if (status & BIT(i))
+                atomic_inc(&fpga.irq_src_count[i]);
+        }
+        total += events;
+        // line still high means another batch is due, its rising edge was while masked
+    } while (events && --budget && gpio_get_value(fpga.fpga_pins.fpga_irq));
+    return total;
+}
 
-    // clear irq pin!!
-    uint8_t curSel = fpga.fpga_addr_sel;
-    fpga.fpga_addr_sel = FPGA_ADDR_CS0;
-    iowrite16(0, sk_fpga_ptr_by_addr(0));
-    fpga.fpga_addr_sel = curSel;
+// Count num in the current window, returns rate per second once the window is over, -1 before
+static s64 sk_fpga_irq_rate (uint32_t num)
+{
+    s64 rate = 0;
+    s64 now = ktime_get_ns();
+    s64 elapsed = now - fpga.irq_rate_start;
+    fpga.irq_rate_num += num;
+    if (elapsed < SK_FPGA_IRQ_RATE_WINDOW_MS * NSEC_PER_MSEC)
+        return -1;
+    rate = div64_s64((s64)fpga.irq_rate_num * NSEC_PER_SEC, elapsed);
+    fpga.irq_rate_start = now;
+    fpga.irq_rate_num = 0;
+    return rate;
+}
 
-    memset(&info, 0, sizeof(struct siginfo));
-    info.si_signo = SIGUSR2;
-    info.si_code = 0;
-    info.si_int = 0;
-    if (current_task == NULL)
+// Mask fpga irq and ack events from hrtimer, irq thread calls it
+static void sk_fpga_irq_poll_start (void)
+{
+    WRITE_ONCE(fpga.irq_polling, true);
+    fpga.irq_rate_start = ktime_get_ns();
+    fpga.irq_rate_num = 0;
+    // can't wait for the thread calling it
+    disable_irq_nosync(fpga.irq_num);
+    hrtimer_start(&fpga.irq_poll_timer, us_to_ktime(max_t(uint, READ_ONCE(irq_poll_us), SK_FPGA_IRQ_POLL_MIN_US)),
+                  HRTIMER_MODE_REL);
+}
+
+// Poll fpga events while their rate stays high, then go back to irq
+static enum hrtimer_restart sk_fpga_irq_poll (struct hrtimer* timer)
+{
+    s64 rate = 0;
+    uint32_t mode = READ_ONCE(irq_poll_mode);
+    uint32_t events = sk_fpga_irq_ack(max_t(uint, READ_ONCE(irq_poll_budget), 1));
+
+    if (events)
     {
-        rcu_read_lock();
-        current_task = pid_task(find_vpid(fpga.pid), PIDTYPE_PID);
-        rcu_read_unlock();
+        atomic64_set(&fpga.irq_stamp_ns, ktime_get_ns());
+        atomic_add(events, &fpga.irq_count);
+        sk_fpga_status_update(0, 0);
+        wake_up_interruptible(&fpga.irq_wait);
+    }
+    rate = sk_fpga_irq_rate(events);
+    if ((mode == SK_FPGA_IRQ_POLL_OFF) ||
+        ((mode == SK_FPGA_IRQ_POLL_ADAPTIVE) && (rate >= 0) && (rate < READ_ONCE(irq_poll_exit))))
+    {
+        WRITE_ONCE(fpga.irq_polling, false);
+        fpga.irq_rate_start = ktime_get_ns();
+        fpga.irq_rate_num = 0;
+        // an edge that came while masked is replayed
+        enable_irq(fpga.irq_num);
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, us_to_ktime(max_t(uint, READ_ONCE(irq_poll_us), SK_FPGA_IRQ_POLL_MIN_US)));
+    return HRTIMER_RESTART;
+}
+
+static const char* sk_fpga_lat_names[SK_FPGA_LAT_LAST] = {
+    "irq_thread",
+    "irq_read",
+    "dma",
+    "dma_async",
+};
+
+// Values below 1 << SK_FPGA_LAT_SUB_BITS get own buckets, every power of 2 above
+// is split into 1 << SK_FPGA_LAT_SUB_BITS linear ones
+static uint32_t sk_fpga_lat_bucket (uint64_t ns)
+{
+    uint32_t shift = 0;
+    if (ns < BIT(SK_FPGA_LAT_SUB_BITS))
+        return ns;
+    shift = fls64(ns) - 1 - SK_FPGA_LAT_SUB_BITS;
+    return ((shift + 1) << SK_FPGA_LAT_SUB_BITS) + ((ns >> shift) & (BIT(SK_FPGA_LAT_SUB_BITS) - 1));
+}
+
+static uint64_t sk_fpga_lat_bucket_start (uint32_t idx)
+{
+    uint32_t shift = 0;
+    if (idx < BIT(SK_FPGA_LAT_SUB_BITS))
+        return idx;
+    shift = (idx >> SK_FPGA_LAT_SUB_BITS) - 1;
+    return (uint64_t)(BIT(SK_FPGA_LAT_SUB_BITS) + (idx & (BIT(SK_FPGA_LAT_SUB_BITS) - 1))) << shift;
+}
+
+// Called from any context, the irq hard handler and timers included
+static void sk_fpga_lat_add (enum sk_fpga_lat which, s64 ns)
+{
+    unsigned long flags;
+    struct sk_fpga_lat_hist* h = &fpga.lat[which];
+    uint64_t val = (ns > 0) ? ns : 0;
+    spin_lock_irqsave(&h->lock, flags);
+    h->buckets[sk_fpga_lat_bucket(val)]++;
+    h->count++;
+    h->sum += val;
+    h->min = min(h->min, val);
+    h->max = max(h->max, val);
+    spin_unlock_irqrestore(&h->lock, flags);
+}
+
+static void sk_fpga_lat_reset (void)
+{
+    int i = 0;
+    unsigned long flags;
+    struct sk_fpga_lat_hist* h = NULL;
+    for (i = 0; i < SK_FPGA_LAT_LAST; i++)
+    {
+        h = &fpga.lat[i];
+        spin_lock_irqsave(&h->lock, flags);
+        memset(h->buckets, 0, sizeof(h->buckets));
+        h->count = 0;
+        h->sum = 0;
+        h->min = U64_MAX;
+        h->max = 0;
+        spin_unlock_irqrestore(&h->lock, flags);
     }
-    ret = send_sig_info(SIGUSR2, &info, current_task);
-    if (ret < 0) 
+}
+
+// Any context, only the local cpu's copy is touched
+static void sk_fpga_stat_add (enum sk_fpga_stat stat, uint64_t val)
+{
+    this_cpu_add(fpga.stats->val[stat], val);
+}
+
+// One access of bytes which kept the bus busy_ns long
+static void sk_fpga_stat_op (enum sk_fpga_stat ops, uint64_t bytes, s64 busy_ns)
+{
+    sk_fpga_stat_add(ops, 1);
+    sk_fpga_stat_add(ops + 1, bytes);
+    if (busy_ns > 0)
+        sk_fpga_stat_add(SK_FPGA_STAT_BUSY_NS, busy_ns);
+}
+
+// Sums may be a little behind the counters updated meanwhile
+static ssize_t sk_fpga_stat_show (struct device* dev, struct device_attribute* attr, char* buf)
+{
+    int cpu = 0;
+    uint64_t sum = 0;
+    enum sk_fpga_stat stat = container_of(attr, struct sk_fpga_stat_attr, attr)->stat;
+    for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(fpga.stats, cpu)->val[stat];
+    return sprintf(buf, "%llu\n", sum);
+}
+
+// Any context, readers retry while seq is odd or has changed under them
+static void sk_fpga_status_update (uint32_t dma_submitted, uint32_t dma_completed)
+{
+    unsigned long flags;
+    struct sk_fpga_status* st = fpga.status;
+    spin_lock_irqsave(&fpga.status_lock, flags);
+    WRITE_ONCE(st->seq, st->seq + 1);
+    smp_wmb();
+    st->irq_count = atomic_read(&fpga.irq_count);
+    st->irq_stamp_ns = atomic64_read(&fpga.irq_stamp_ns);
+    st->dma_submitted += dma_submitted;
+    st->dma_completed += dma_completed;
+    st->prog_state = fpga.prog_state;
+    st->reset = gpio_get_value(fpga.fpga_pins.fpga_reset);
+    st->host_irq = gpio_get_value(fpga.fpga_pins.host_irq);
+    st->fpga_irq = gpio_get_value(fpga.fpga_pins.fpga_irq);
+    smp_wmb();
+    WRITE_ONCE(st->seq, st->seq + 1);
+    spin_unlock_irqrestore(&fpga.status_lock, flags);
+}
+
+static int sk_fpga_mmap_status (struct vm_area_struct* vma, unsigned long off)
+{
+    if (off || (vma->vm_end - vma->vm_start != PAGE_SIZE))
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    // no mprotect() to writable later
+    vma->vm_flags &= ~VM_MAYWRITE;
+    // vm_pgoff is taken as an offset into the buffer, not into the region
+    vma->vm_pgoff = 0;
+    return dma_mmap_coherent(&fpga.pdev->dev, vma, fpga.status, fpga.status_addr, PAGE_SIZE);
+}
+
+// Percentiles are upper bounds of the buckets they fall into
+static int sk_fpga_lat_show (struct seq_file* m, void* v)
+{
+    static const uint32_t permille[] = {500, 900, 990, 999};
+    unsigned long flags;
+    uint32_t i = 0;
+    uint32_t p = 0;
+    uint64_t seen = 0;
+    struct sk_fpga_lat_hist* h = NULL;
+
+    // copied so the lock isn't held while printing
+    h = kmalloc(sizeof(struct sk_fpga_lat_hist), GFP_KERNEL);
+    if (!h)
+        return -ENOMEM;
+    spin_lock_irqsave(&((struct sk_fpga_lat_hist*)m->private)->lock, flags);
+    memcpy(h, m->private, sizeof(struct sk_fpga_lat_hist));
+    spin_unlock_irqrestore(&((struct sk_fpga_lat_hist*)m->private)->lock, flags);
+
+    seq_printf(m, "count %llu\n", h->count);
+    if (h->count)
     {
-        printk(KERN_ALERT"Failed to send a signal");
-        BUG_ON(1);
+        seq_printf(m, "min %llu\nmax %llu\navg %llu\n", h->min, h->max, div64_u64(h->sum, h->count));
+        for (i = 0; i < SK_FPGA_LAT_BUCKETS; i++)
+        {
+            seen += h->buckets[i];
+            while ((p < ARRAY_SIZE(permille)) && (seen * 1000 >= h->count * permille[p]))
+            {
+                seq_printf(m, "p%u %llu\n", permille[p], min(h->max, sk_fpga_lat_bucket_start(i + 1) - 1));
+                p++;
+            }
+        }
+        // bucket start in ns and count
+        for (i = 0; i < SK_FPGA_LAT_BUCKETS; i++)
+        {
+            if (h->buckets[i])
+                seq_printf(m, "%llu %u\n", sk_fpga_lat_bucket_start(i), h->buckets[i]);
+        }
     }
-    return IRQ_HANDLED;
+    kfree(h);
+    return 0;
+}
+
+static int sk_fpga_lat_open (struct inode* inode, struct file* file)
+{
+    return single_open(file, sk_fpga_lat_show, inode->i_private);
+}
+
+static const struct file_operations sk_fpga_lat_fops = {
+        .owner          = THIS_MODULE,
+        .open           = sk_fpga_lat_open,
+        .read           = seq_read,
+        .llseek         = seq_lseek,
+        .release        = single_release,
+};
+
+// Any write clears all histograms
+static ssize_t sk_fpga_lat_reset_write (struct file* file, const char __user* buf, size_t len, loff_t* ppos)
+{
+    sk_fpga_lat_reset();
+    return len;
+}
+
+static const struct file_operations sk_fpga_lat_reset_fops = {
+        .owner          = THIS_MODULE,
+        .write          = sk_fpga_lat_reset_write,
+        .llseek         = no_llseek,
+};
+
+// Histograms are optional, the driver works without debugfs
+static void sk_fpga_debugfs_init (void)
+{
+    int i = 0;
+    fpga.debugfs = debugfs_create_dir("sk_fpga", NULL);
+    if (IS_ERR_OR_NULL(fpga.debugfs))
+    {
+        fpga.debugfs = NULL;
+        return;
+    }
+    for (i = 0; i < SK_FPGA_LAT_LAST; i++)
+        debugfs_create_file(sk_fpga_lat_names[i], 0444, fpga.debugfs, &fpga.lat[i], &sk_fpga_lat_fops);
+    debugfs_create_file("reset", 0200, fpga.debugfs, NULL, &sk_fpga_lat_reset_fops);
 }
 
 void sk_fpga_dma_callback (void)
@@ -394,6 +2332,18 @@ void sk_fpga_dma_callback (void)
     int ret = 0;
     struct task_struct* current_task = NULL;
     struct siginfo info;
+    // next SKFPGA_IOSDMA may reuse these once the flag is cleared
+    struct sk_fpga_dma_transaction tran = fpga.dma_submit_tran;
+    int cookie = fpga.dma_submit_cookie;
+    s64 busy_ns = ktime_get_ns() - fpga.dma_submit_ns;
+
+    // failed sync transfer is completed by its submitter
+    if (!atomic_xchg(&fpga.dma_legacy_busy, 0))
+        return;
+    sk_fpga_lat_add(SK_FPGA_LAT_DMA, busy_ns);
+    sk_fpga_stat_op(SK_FPGA_STAT_DMA_OPS(tran.dir), tran.len, busy_ns);
+    sk_fpga_status_update(0, 1);
+    trace_sk_fpga_dma_complete(cookie, tran.len, tran.dir, 0);
     memset(&info, 0, sizeof(struct siginfo));
     info.si_signo = SIGUSR1;
     info.si_code = 0;
@@ -538,6 +2488,10 @@ int sk_fpga_fill_structure(struct platform_device *pdev)
         printk(KERN_ALERT"Failed to obtain start phys mem start address from dtb\n");
         return -ENOMEM;
     }
+
+    // firmware to program at boot is optional
+    if (of_property_read_string(pdev->dev.of_node, "firmware-name", &fpga.fw_name))
+        fpga.fw_name = NULL;
     
     fpga.fpga_mem_virt_start_cs0 = NULL;
     fpga.fpga_mem_virt_start_cs1 = NULL;
@@ -547,9 +2501,40 @@ int sk_fpga_fill_structure(struct platform_device *pdev)
 
 static int sk_fpga_probe (struct platform_device *pdev)
 {
+    int i = 0;
     int ret = -EIO;
     memset(&fpga, 0, sizeof(fpga));
     fpga.pdev = pdev;
+    // sysfs shows them as soon as the device is registered
+    fpga.stats = alloc_percpu(struct sk_fpga_stats);
+    if (!fpga.stats)
+        return -ENOMEM;
+    fpga.status = dma_alloc_coherent(&pdev->dev, PAGE_SIZE, &fpga.status_addr, GFP_KERNEL);
+    if (!fpga.status)
+    {
+        ret = -ENOMEM;
+        goto free_stats;
+    }
+    atomic_set(&fpga.irq_count, 0);
+    fpga.irq_coalesce.count = 1;
+    hrtimer_init(&fpga.irq_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    for (i = 0; i < SK_FPGA_LAT_LAST; i++)
+        spin_lock_init(&fpga.lat[i].lock);
+    sk_fpga_lat_reset();
+    fpga.irq_poll_timer.function = sk_fpga_irq_poll;
+    atomic_set(&fpga.dma_cookie, 0);
+    init_waitqueue_head(&fpga.irq_wait);
+    spin_lock_init(&fpga.bus_lock);
+    spin_lock_init(&fpga.status_lock);
+    mutex_init(&fpga.ctrl_lock);
+    mutex_init(&fpga.capture_lock);
+    mutex_init(&fpga.dma_chan_lock);
+    atomic_set(&fpga.dma_async_active, 0);
+    atomic_set(&fpga.dma_legacy_busy, 0);
+    spin_lock_init(&fpga.capture_idx_lock);
+    atomic_set(&fpga.capture_maps, 0);
+    init_waitqueue_head(&fpga.capture_wait);
+    init_waitqueue_head(&fpga.prog_wait);
 
     printk(KERN_ALERT"Loading FPGA driver for SK-AT91SAM9M10G45EK-XC6SLX\n");
 
@@ -557,7 +2542,8 @@ static int sk_fpga_probe (struct platform_device *pdev)
     ret = misc_register(&sk_fpga_dev);
     if (ret) {
         printk(KERN_ALERT"Unable to register \"fpga\" misc device\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto free_status;
     }
 
     // fill structure by dtb info
@@ -676,14 +2662,30 @@ static int sk_fpga_probe (struct platform_device *pdev)
     }
 
     // device is not yet opened
-    fpga.opened = 0;
-    fpga.fpga_addr_sel = FPGA_ADDR_UNDEFINED;
+    atomic_set(&fpga.opened, 0);
 
     ret = sk_fpga_setup_dma(pdev);
     if (ret)
     {
         goto release_host_irq_pin;
     }
+
+    // bus isn't set up for the design yet, data path stays PIO till it's measured
+    fpga.dma_threshold_measured = -1;
+
+    // boot goes on while the firmware is loaded and shifted out
+    if (fpga.fw_name)
+    {
+        fpga.boot_pending = true;
+        if (request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, fpga.fw_name, &pdev->dev,
+                                    GFP_KERNEL, NULL, sk_fpga_boot_fw_done))
+        {
+            printk(KERN_ALERT"Failed to request firmware %s", fpga.fw_name);
+            fpga.boot_pending = false;
+        }
+    }
+    sk_fpga_debugfs_init();
+    sk_fpga_status_update(0, 0);
     
     return ret;
 
@@ -705,6 +2707,10 @@ free_buf:
     kfree(fpga.fpga_prog_buffer);
 misc_dereg:
     misc_deregister(&sk_fpga_dev);
+free_status:
+    dma_free_coherent(&pdev->dev, PAGE_SIZE, fpga.status, fpga.status_addr);
+free_stats:
+    free_percpu(fpga.stats);
     return ret;
 }
 
@@ -756,6 +2762,13 @@ int sk_fpga_setup_dma (struct platform_device *pdev)
         err = -ENOMEM;
         goto release_chan;
     }
+    fpga.bounce_buf = dma_alloc_coherent(&pdev->dev, DMA_BUF_SIZE, &fpga.bounce_addr_buf, GFP_KERNEL | GFP_DMA);
+    if (!fpga.bounce_buf)
+    {
+        dma_free_coherent(&pdev->dev, DMA_BUF_SIZE, fpga.dma_buf, fpga.dma_addr_buf);
+        err = -ENOMEM;
+        goto release_chan;
+    }
     
     return err;
 
@@ -792,11 +2805,110 @@ int sk_fpga_dma_config_slave ()
     return err;
 }
 
+// Time PIO and dma reads of growing size and set dma_threshold to the size from
+// which dma stays faster, only reads are done so fpga contents are kept
+static void sk_fpga_dma_calibrate (void)
+{
+    int i = 0;
+    int threshold = INT_MAX;
+    unsigned long flags;
+    uint32_t size = 0;
+    uint32_t chunk = 0;
+    uint32_t done = 0;
+    s64 start = 0;
+    s64 pio_ns = 0;
+    s64 dma_ns = 0;
+    uint16_t* tmp = NULL;
+    uint8_t* dst = NULL;
+
+    tmp = kmalloc(TMP_BUF_SIZE, GFP_KERNEL);
+    dst = kmalloc(DMA_BUF_SIZE, GFP_KERNEL);
+    if (!tmp || !dst)
+        goto free_bufs;
+
+    for (size = SK_FPGA_DMA_CAL_MIN; size <= min_t(uint32_t, DMA_BUF_SIZE, fpga.fpga_mem_window_size); size <<= 1)
+    {
+        pio_ns = S64_MAX;
+        dma_ns = S64_MAX;
+        for (i = 0; i < SK_FPGA_DMA_CAL_RUNS; i++)
+        {
+            // both include the copy out of the transfer buffer, as read() does
+            start = ktime_get_ns();
+            for (done = 0; done < size; done += chunk)
+            {
+                chunk = min_t(uint32_t, size - done, TMP_BUF_SIZE);
+                spin_lock_irqsave(&fpga.bus_lock, flags);
+                sk_fpga_window_read(tmp, fpga.fpga_mem_virt_start_cs0 + done / sizeof(uint16_t), chunk / sizeof(uint16_t));
+                spin_unlock_irqrestore(&fpga.bus_lock, flags);
+                memcpy(dst + done, tmp, chunk);
+            }
+            pio_ns = min_t(s64, pio_ns, ktime_get_ns() - start);
+
+            start = ktime_get_ns();
+            mutex_lock(&fpga.dma_chan_lock);
+            // capture or queued transfers would skew the numbers, keep the old ones
+            if (sk_fpga_dma_chan_busy())
+            {
+                mutex_unlock(&fpga.dma_chan_lock);
+                threshold = READ_ONCE(dma_threshold);
+                goto free_bufs;
+            }
+            if (sk_fpga_dma_bounce(fpga.fpga_mem_phys_start_cs0, size, DMA_FPGA_TO_ARM))
+            {
+                mutex_unlock(&fpga.dma_chan_lock);
+                threshold = INT_MAX;
+                goto free_bufs;
+            }
+            memcpy(dst, fpga.bounce_buf, size);
+            mutex_unlock(&fpga.dma_chan_lock);
+            dma_ns = min_t(s64, dma_ns, ktime_get_ns() - start);
+        }
+        // crossover is where dma starts to win and keeps winning
+        if (dma_ns < pio_ns)
+        {
+            if (threshold == INT_MAX)
+                threshold = size;
+        }
+        else
+        {
+            threshold = INT_MAX;
+        }
+    }
+
+free_bufs:
+    kfree(tmp);
+    kfree(dst);
+    WRITE_ONCE(dma_threshold, threshold);
+    fpga.dma_threshold_measured = threshold;
+    if ((threshold < 0) || (threshold == INT_MAX))
+        printk(KERN_ALERT"Data read()/write() use PIO only");
+    else
+        printk(KERN_ALERT"Data read()/write() use dma from %d bytes", threshold);
+}
+
+// Measure the threshold again for the current design and bus timings, unless
+// dma_threshold was set to a fixed value. Called with ctrl_lock held
+static void sk_fpga_dma_recalibrate (void)
+{
+    int threshold = READ_ONCE(dma_threshold);
+    if ((threshold >= 0) && (threshold != fpga.dma_threshold_measured))
+        return;
+    sk_fpga_dma_calibrate();
+}
+
 static int sk_fpga_remove (struct platform_device *pdev)
 {
     printk(KERN_ALERT"Removing FPGA driver for SK-AT91SAM9M10G45EK-XC6SLX\n");
+    // boot programming callback uses everything below
+    wait_event(fpga.prog_wait, !READ_ONCE(fpga.boot_pending));
+    debugfs_remove_recursive(fpga.debugfs);
     misc_deregister(&sk_fpga_dev);
+    // poll timer must not outlive the module
+    if (fpga.irq_num)
+        sk_fpga_unregister_irq();
     kfree(fpga.fpga_prog_buffer);
+    kfree(fpga.prog_seq);
+    sk_fpga_bit_cache_free();
     iounmap(fpga.fpga_mem_virt_start_cs0);
     release_mem_region(fpga.fpga_mem_phys_start_cs0, fpga.fpga_mem_window_size);
     iounmap(fpga.fpga_mem_virt_start_cs1);
@@ -804,8 +2916,18 @@ static int sk_fpga_remove (struct platform_device *pdev)
     gpio_free(fpga.fpga_pins.fpga_reset);
     gpio_free(fpga.fpga_pins.fpga_irq);
     gpio_free(fpga.fpga_pins.host_irq);
+    mutex_lock(&fpga.capture_lock);
+    sk_fpga_capture_stop();
+    mutex_unlock(&fpga.capture_lock);
+    if (fpga.capture_buf)
+        dma_free_coherent(&pdev->dev, fpga.capture_size, fpga.capture_buf, fpga.capture_addr_buf);
+    if (fpga.capture_hdr)
+        free_page((unsigned long)fpga.capture_hdr);
+    dma_free_coherent(&pdev->dev, DMA_BUF_SIZE, fpga.bounce_buf, fpga.bounce_addr_buf);
     dma_free_coherent(&pdev->dev, DMA_BUF_SIZE, fpga.dma_buf, fpga.dma_addr_buf);
     dma_release_channel(fpga.fpga_dma_chan);
+    dma_free_coherent(&pdev->dev, PAGE_SIZE, fpga.status, fpga.status_addr);
+    free_percpu(fpga.stats);
     return 0;
 }
 
@@ -814,6 +2936,7 @@ int sk_fpga_prepare_to_program (void)
 {
     int ret = 0;
     printk(KERN_ALERT"FPGA programming is started");
+    fpga.prog_start_ns = ktime_get_ns();
     // acquire pins to program FPGA
     gpio_free(fpga.fpga_pins.fpga_done);
     gpio_free(fpga.fpga_pins.fpga_din);
@@ -844,9 +2967,19 @@ int sk_fpga_prepare_to_program (void)
     }
     gpio_direction_input(fpga.fpga_pins.fpga_done);
 
+    fpga.loaded_valid = false;
+    WRITE_ONCE(fpga.prog_busy, true);
+    fpga.prog_state = SK_FPGA_PROG_STATE_BUSY;
+    sk_fpga_status_update(0, 0);
+    fpga.prog_engine = SK_FPGA_PROG_GPIO;
+    fpga.prog_verified = !prog_verify;
+    if ((prog_engine == SK_FPGA_PROG_PIO) && !sk_fpga_prog_pio_setup())
+        fpga.prog_engine = SK_FPGA_PROG_PIO;
+
     // perform sort of firmware reset on fpga
     gpio_set_value(fpga.fpga_pins.fpga_prog, 0);
     gpio_set_value(fpga.fpga_pins.fpga_prog, 1);
+    trace_sk_fpga_prog_prepare(fpga.prog_engine, 0);
     return 0;
 
 release_done_pin:
@@ -857,19 +2990,82 @@ release_cclk_pin:
     gpio_free(fpga.fpga_pins.fpga_cclk);
 release_prog_pin:
     gpio_free(fpga.fpga_pins.fpga_prog);
+    trace_sk_fpga_prog_prepare(fpga.prog_engine, -ENODEV);
+    fpga.prog_state = SK_FPGA_PROG_STATE_FAILED;
+    sk_fpga_status_update(0, 0);
     return -ENODEV;
 }
 
-// TODO: refactoring needed
-void sk_fpga_program (const uint8_t* buff, uint32_t bufLen)
+// Map PIO bank of din and cclk and precompute ODSR values for every byte
+static int sk_fpga_prog_pio_setup (void)
+{
+    int i, j;
+    uint32_t din = 0;
+    uint32_t bank = fpga.fpga_pins.fpga_din / 32;
+
+    if ((bank >= PIO_BANK_NUM) || (bank != fpga.fpga_pins.fpga_cclk / 32))
+    {
+        printk(KERN_ALERT"din and cclk are not on the same PIO bank, using gpiolib");
+        return -EINVAL;
+    }
+    fpga.prog_din_mask = 1 << (fpga.fpga_pins.fpga_din % 32);
+    fpga.prog_cclk_mask = 1 << (fpga.fpga_pins.fpga_cclk % 32);
+
+    if (!fpga.prog_seq)
+    {
+        fpga.prog_seq = kmalloc(256 * 16 * sizeof(uint32_t), GFP_KERNEL);
+        if (!fpga.prog_seq)
+            return -ENOMEM;
+    }
+    // msb goes first, din changes together with cclk falling edge and is sampled on the rising one
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            din = (i & (0x80 >> j)) ? fpga.prog_din_mask : 0;
+            fpga.prog_seq[i * 16 + j * 2] = din;
+            fpga.prog_seq[i * 16 + j * 2 + 1] = din | fpga.prog_cclk_mask;
+        }
+    }
+
+    // pin controller owns the region, so no request_mem_region here
+    fpga.prog_pio = ioremap(PIO_ADDRESS + bank * PIO_BANK_WINDOW, PIO_BANK_WINDOW);
+    if (!fpga.prog_pio)
+        return -ENOMEM;
+    // ODSR writes touch din and cclk only
+    writel(fpga.prog_din_mask | fpga.prog_cclk_mask, fpga.prog_pio + PIO_OWER);
+    return 0;
+}
+
+static void sk_fpga_prog_pio_release (void)
+{
+    if (!fpga.prog_pio)
+        return;
+    writel(fpga.prog_din_mask | fpga.prog_cclk_mask, fpga.prog_pio + PIO_OWDR);
+    iounmap(fpga.prog_pio);
+    fpga.prog_pio = NULL;
+}
+
+// Shift bytes out with gpiolib, pin states are recorded instead when rec is set
+static void sk_fpga_program_gpio (const uint8_t* buff, uint32_t bufLen, uint32_t* rec)
 {
     int i, j;
     unsigned char byte;
     unsigned char bit;
+    uint32_t din = 0;
     for (i = 0; i < bufLen; i++) {
         byte = buff[i];
         for (j = 7; j >= 0; j--) {
             bit = (1 << j) & byte;
+            if (unlikely(rec))
+            {
+                din = bit ? fpga.prog_din_mask : 0;
+                // cclk is low after the previous bit
+                *rec++ = din;
+                *rec++ = din | fpga.prog_cclk_mask;
+                *rec++ = din;
+                continue;
+            }
             gpio_set_value(fpga.fpga_pins.fpga_din, bit ? 1 : 0);
             gpio_set_value(fpga.fpga_pins.fpga_cclk, 1);
             gpio_set_value(fpga.fpga_pins.fpga_cclk, 0);
@@ -877,11 +3073,108 @@ void sk_fpga_program (const uint8_t* buff, uint32_t bufLen)
     }
 }
 
+// Shift bytes out with two ODSR writes per bit, values are recorded instead when rec is set
+static void sk_fpga_program_pio (const uint8_t* buff, uint32_t bufLen, uint32_t* rec)
+{
+    int i, j;
+    const uint32_t* seq = NULL;
+    void __iomem* odsr = fpga.prog_pio + PIO_ODSR;
+    for (i = 0; i < bufLen; i++) {
+        seq = &fpga.prog_seq[buff[i] * 16];
+        if (unlikely(rec))
+        {
+            memcpy(rec, seq, 16 * sizeof(uint32_t));
+            rec += 16;
+            continue;
+        }
+        for (j = 0; j < 16; j++)
+            writel_relaxed(seq[j], odsr);
+    }
+    // leave cclk low like gpiolib engine does
+    if (!rec && bufLen)
+        writel_relaxed(seq[14], odsr);
+}
+
+// Extract din values sampled on cclk rising edges from a recorded waveform
+static uint32_t sk_fpga_wave_samples (const uint32_t* rec, uint32_t num, uint8_t* bits)
+{
+    uint32_t i = 0;
+    uint32_t n = 0;
+    uint32_t prev = 0;
+    for (i = 0; i < num; i++)
+    {
+        if ((rec[i] & fpga.prog_cclk_mask) && !(prev & fpga.prog_cclk_mask))
+            bits[n++] = (rec[i] & fpga.prog_din_mask) ? 1 : 0;
+        prev = rec[i];
+    }
+    return n;
+}
+
+// Replay the first bytes through both engines and compare what fpga would sample
+static int sk_fpga_prog_verify (const uint8_t* buff, uint32_t bufLen)
+{
+    int ret = 0;
+    uint32_t n_gpio = 0;
+    uint32_t n_pio = 0;
+    uint32_t* rec_gpio = NULL;
+    uint32_t* rec_pio = NULL;
+    uint8_t* bits_gpio = NULL;
+    uint8_t* bits_pio = NULL;
+
+    bufLen = min_t(uint32_t, bufLen, SK_FPGA_PROG_VERIFY_LEN);
+    rec_gpio = kcalloc(bufLen * 8 * 3, sizeof(uint32_t), GFP_KERNEL);
+    rec_pio = kcalloc(bufLen * 8 * 2, sizeof(uint32_t), GFP_KERNEL);
+    bits_gpio = kcalloc(bufLen * 8, 2, GFP_KERNEL);
+    bits_pio = bits_gpio + bufLen * 8;
+    if (!rec_gpio || !rec_pio || !bits_gpio)
+    {
+        ret = -ENOMEM;
+        goto free_bufs;
+    }
+
+    sk_fpga_program_gpio(buff, bufLen, rec_gpio);
+    sk_fpga_program_pio(buff, bufLen, rec_pio);
+    n_gpio = sk_fpga_wave_samples(rec_gpio, bufLen * 8 * 3, bits_gpio);
+    n_pio = sk_fpga_wave_samples(rec_pio, bufLen * 8 * 2, bits_pio);
+    if ((n_gpio != bufLen * 8) || (n_gpio != n_pio) || memcmp(bits_gpio, bits_pio, n_gpio))
+    {
+        printk(KERN_ALERT"PIO engine waveform differs from gpiolib one: %u vs %u edges", n_pio, n_gpio);
+        ret = -EIO;
+    }
+
+free_bufs:
+    kfree(bits_gpio);
+    kfree(rec_pio);
+    kfree(rec_gpio);
+    return ret;
+}
+
+void sk_fpga_program (const uint8_t* buff, uint32_t bufLen)
+{
+    if (!fpga.prog_verified && (fpga.prog_engine == SK_FPGA_PROG_PIO))
+    {
+        fpga.prog_verified = true;
+        if (sk_fpga_prog_verify(buff, bufLen))
+        {
+            sk_fpga_prog_pio_release();
+            fpga.prog_engine = SK_FPGA_PROG_GPIO;
+        }
+    }
+    trace_sk_fpga_prog_shift(fpga.prog_engine, bufLen);
+    if (fpga.prog_engine == SK_FPGA_PROG_PIO)
+        sk_fpga_program_pio(buff, bufLen, NULL);
+    else
+        sk_fpga_program_gpio(buff, bufLen, NULL);
+}
+
 // TODO: refactoring needed
 int sk_fpga_programming_done (void)
 {
     int counter, i, done = 0;
     int ret = 0;
+    s64 prog_ns = 0;
+    // gpiolib takes the pins over again
+    sk_fpga_prog_pio_release();
     gpio_set_value(fpga.fpga_pins.fpga_din, 1);
     done = gpio_get_value(fpga.fpga_pins.fpga_done);
     counter = 0;
@@ -900,105 +3193,673 @@ int sk_fpga_programming_done (void)
             goto finish;
         }
     }
-    // toggle clock a little bit just to ensure nothing's wrong
-    for (i = 0; i < 10; i++) 
+    // DONE goes high in the middle of startup, GTS and GWE are released
+    // a few cclks later, compressed bitstreams need no extra ones
+    for (i = 0; i < SK_FPGA_STARTUP_CCLKS; i++) 
     {
         gpio_set_value(fpga.fpga_pins.fpga_cclk, 1);
         gpio_set_value(fpga.fpga_pins.fpga_cclk, 0);
     }
 
 finish:
+    trace_sk_fpga_prog_done(counter, ret);
+    prog_ns = ktime_get_ns() - fpga.prog_start_ns;
+    sk_fpga_stat_add(SK_FPGA_STAT_PROG_RUNS, 1);
+    sk_fpga_stat_add(SK_FPGA_STAT_PROG_NS, prog_ns);
+    sk_fpga_stat_add(SK_FPGA_STAT_BUSY_NS, prog_ns);
     if (!ret)
+    {
         printk(KERN_ALERT"FPGA programming is done");
+        // other designs don't have the registers, only touch them when asked to
+        if (fpga.irq_coalesce_set)
+            sk_fpga_irq_coalesce_apply();
+    }
     // release program pins
     gpio_free(fpga.fpga_pins.fpga_done);
     gpio_free(fpga.fpga_pins.fpga_din);
     gpio_free(fpga.fpga_pins.fpga_cclk);
     gpio_free(fpga.fpga_pins.fpga_prog);
+    WRITE_ONCE(fpga.prog_busy, false);
+    if (!ret)
+        sk_fpga_dma_recalibrate();
+    fpga.prog_state = ret ? SK_FPGA_PROG_STATE_FAILED : SK_FPGA_PROG_STATE_DONE;
+    sk_fpga_status_update(0, 0);
+    wake_up_all(&fpga.prog_wait);
     return ret;
 }
 
-int sk_fpga_prog (char* fName)
+static void sk_fpga_bit_init (struct sk_fpga_bit_parser* p)
+{
+    memset(p, 0, sizeof(struct sk_fpga_bit_parser));
+    p->state = SK_FPGA_BIT_DETECT;
+    p->need = sizeof(uint16_t);
+}
+
+// Collect a big endian number, true once all of its bytes are there
+static bool sk_fpga_bit_number (struct sk_fpga_bit_parser* p, const uint8_t** buf, uint32_t* len)
+{
+    while (p->need && *len)
+    {
+        p->acc = (p->acc << 8) | **buf;
+        (*buf)++;
+        (*len)--;
+        p->need--;
+    }
+    return !p->need;
+}
+
+// Walk configuration packets to find out whether the bitstream is compressed.
+// Spartan-6 packets are 16 bit: type 1 header carries register and word count,
+// type 2 header is followed by a 32 bit word count. Payload is skipped, so
+// frame data can't be taken for a header.
+static void sk_fpga_bit_scan (struct sk_fpga_bit_parser* p, const uint8_t* buf, uint32_t len)
+{
+    uint32_t i = 0;
+    uint16_t w = 0;
+    for (i = 0; i < len; i++)
+    {
+        p->offset++;
+        if (!p->sync_offset)
+        {
+            p->sync = (p->sync << 8) | buf[i];
+            if (p->sync == SK_FPGA_SYNC_WORD)
+                p->sync_offset = p->offset;
+            continue;
+        }
+        p->word = (p->word << 8) | buf[i];
+        p->half = !p->half;
+        if (p->half)
+            continue;
+        w = p->word;
+        if (p->count_words)
+        {
+            p->skip = (p->skip << 16) | w;
+            p->count_words--;
+        }
+        else if (p->skip)
+        {
+            p->skip--;
+        }
+        else if ((w >> 13) == 1)
+        {
+            // write to MFWR
+            if ((((w >> 11) & 0x3) == 2) && (((w >> 5) & 0x3f) == SK_FPGA_REG_MFWR))
+                p->compressed = true;
+            p->skip = w & 0x1f;
+        }
+        else if ((w >> 13) == 2)
+        {
+            p->skip = 0;
+            p->count_words = 2;
+        }
+    }
+}
+
+// Pass bitstream bytes on: shift them out or collect them, hash if requested
+static int sk_fpga_bit_emit (struct sk_fpga_bit_parser* p, const uint8_t* buf, uint32_t len)
+{
+    sk_fpga_bit_scan(p, buf, len);
+    if (p->hash)
+        crypto_shash_update(p->hash, buf, len);
+    if (!p->out)
+    {
+        sk_fpga_program(buf, len);
+        return 0;
+    }
+    if (len > p->out_cap - p->out_len)
+        return -EFBIG;
+    memcpy(p->out + p->out_len, buf, len);
+    p->out_len += len;
+    return 0;
+}
+
+// Strip .bit header on the fly and shift the bitstream out, the header may be
+// split between calls in any way
+static int sk_fpga_bit_feed (struct sk_fpga_bit_parser* p, const uint8_t* buf, uint32_t len)
 {
     int ret = 0;
-    struct file *f;
-    mm_segment_t fs;
-    ssize_t len = 0;
-    loff_t off = 0;
+    uint32_t chunk = 0;
+    while (len)
+    {
+        switch (p->state)
+        {
+        case SK_FPGA_BIT_DETECT:
+            if (!sk_fpga_bit_number(p, &buf, &len))
+                break;
+            if (p->acc != 0x0009)
+            {
+                // raw bitstream, bytes used for detection belong to it
+                uint8_t head[2] = { p->acc >> 8, p->acc & 0xff };
+                ret = sk_fpga_bit_emit(p, head, sizeof(head));
+                if (ret)
+                    return ret;
+                p->state = SK_FPGA_BIT_RAW;
+                break;
+            }
+            p->state = SK_FPGA_BIT_HDR;
+            p->need = 9;
+            break;
+
+        case SK_FPGA_BIT_HDR:
+        case SK_FPGA_BIT_FIELD:
+            chunk = min(len, p->need);
+            if ((p->state == SK_FPGA_BIT_FIELD) && (p->key == 'a'))
+            {
+                uint32_t room = sizeof(p->design) - 1 - p->design_len;
+                memcpy(p->design + p->design_len, buf, min(chunk, room));
+                p->design_len += min(chunk, room);
+            }
+            buf += chunk;
+            len -= chunk;
+            p->need -= chunk;
+            if (p->need)
+                break;
+            p->state = (p->state == SK_FPGA_BIT_HDR) ? SK_FPGA_BIT_HDR_END : SK_FPGA_BIT_KEY;
+            p->need = (p->state == SK_FPGA_BIT_HDR_END) ? sizeof(uint16_t) : 1;
+            p->acc = 0;
+            break;
+
+        case SK_FPGA_BIT_HDR_END:
+            if (!sk_fpga_bit_number(p, &buf, &len))
+                break;
+            if (p->acc != 0x0001)
+                return -EINVAL;
+            p->state = SK_FPGA_BIT_KEY;
+            p->need = 1;
+            p->acc = 0;
+            break;
+
+        case SK_FPGA_BIT_KEY:
+            p->key = *buf++;
+            len--;
+            p->acc = 0;
+            if (p->key == 'e')
+            {
+                p->state = SK_FPGA_BIT_DATA_LEN;
+                p->need = sizeof(uint32_t);
+            }
+            else if ((p->key >= 'a') && (p->key <= 'd'))
+            {
+                p->state = SK_FPGA_BIT_FIELD_LEN;
+                p->need = sizeof(uint16_t);
+            }
+            else
+            {
+                printk(KERN_ALERT"Unknown bitstream header key 0x%x", p->key);
+                return -EINVAL;
+            }
+            break;
+
+        case SK_FPGA_BIT_FIELD_LEN:
+            if (!sk_fpga_bit_number(p, &buf, &len))
+                break;
+            p->state = SK_FPGA_BIT_FIELD;
+            p->need = p->acc;
+            if (!p->need)
+            {
+                p->state = SK_FPGA_BIT_KEY;
+                p->need = 1;
+            }
+            break;
+
+        case SK_FPGA_BIT_DATA_LEN:
+            if (!sk_fpga_bit_number(p, &buf, &len))
+                break;
+            p->data_left = p->acc;
+            p->state = p->data_left ? SK_FPGA_BIT_DATA : SK_FPGA_BIT_DONE;
+            if (p->design_len)
+                printk(KERN_ALERT"FPGA design: %s, %u bytes", p->design, p->data_left);
+            break;
+
+        case SK_FPGA_BIT_DATA:
+            chunk = min(len, p->data_left);
+            ret = sk_fpga_bit_emit(p, buf, chunk);
+            if (ret)
+                return ret;
+            buf += chunk;
+            len -= chunk;
+            p->data_left -= chunk;
+            if (!p->data_left)
+                p->state = SK_FPGA_BIT_DONE;
+            break;
+
+        case SK_FPGA_BIT_RAW:
+            ret = sk_fpga_bit_emit(p, buf, len);
+            if (ret)
+                return ret;
+            len = 0;
+            break;
+
+        default:
+            len = 0;
+            break;
+        }
+    }
+    return 0;
+}
 
-    if (sk_fpga_prepare_to_program())
+// Check that the whole bitstream went through the parser
+static int sk_fpga_bit_finish (struct sk_fpga_bit_parser* p)
+{
+    if ((p->state != SK_FPGA_BIT_RAW) && (p->state != SK_FPGA_BIT_DONE))
     {
-        return -ENODEV;
+        printk(KERN_ALERT"Bitstream is truncated");
+        return -EINVAL;
+    }
+    if (!p->sync_offset)
+    {
+        printk(KERN_ALERT"No sync word in bitstream");
+        return -EINVAL;
+    }
+    printk(KERN_ALERT"FPGA bitstream: %u bytes, sync at %u, %s", p->offset,
+           p->sync_offset - 4, p->compressed ? "compressed" : "uncompressed");
+    return 0;
+}
+
+// Called with ctrl_lock held
+static int sk_fpga_bit_hash_setup (void)
+{
+    struct crypto_shash* tfm = NULL;
+    if (fpga.prog_hash)
+        return 0;
+    tfm = crypto_alloc_shash("sha256", 0, 0);
+    if (IS_ERR(tfm))
+    {
+        printk(KERN_ALERT"Failed to allocate sha256");
+        return PTR_ERR(tfm);
+    }
+    fpga.prog_hash = kzalloc(sizeof(struct shash_desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
+    if (!fpga.prog_hash)
+    {
+        crypto_free_shash(tfm);
+        return -ENOMEM;
+    }
+    fpga.prog_hash->tfm = tfm;
+    fpga.prog_tfm = tfm;
+    return 0;
+}
+
+static struct sk_fpga_bit_cache_entry* sk_fpga_bit_cache_find (const uint8_t* hash)
+{
+    int i = 0;
+    for (i = 0; i < SK_FPGA_BIT_CACHE_SIZE; i++)
+    {
+        if (fpga.bit_cache[i].data && !memcmp(fpga.bit_cache[i].hash, hash, SK_FPGA_BIT_HASH_LEN))
+            return &fpga.bit_cache[i];
     }
+    return NULL;
+}
 
-    f = filp_open(fName, O_RDONLY, 0);
-    if(f == NULL)
+static struct sk_fpga_bit_cache_entry* sk_fpga_bit_cache_find_name (const char* name)
+{
+    int i = 0;
+    for (i = 0; i < SK_FPGA_BIT_CACHE_SIZE; i++)
     {
-        printk(KERN_ALERT "Failed to open file: %s", fName);
+        if (fpga.bit_cache[i].data && name[0] && !strcmp(fpga.bit_cache[i].name, name))
+            return &fpga.bit_cache[i];
+    }
+    return NULL;
+}
+
+// Strip the header of a loaded image and hash the bitstream, on success it's
+// left in prog_parser.out for the caller to keep or vfree.
+// Called with ctrl_lock held
+static int sk_fpga_bit_parse (const uint8_t* data, size_t size, uint8_t* hash)
+{
+    int ret = 0;
+    struct sk_fpga_bit_parser* p = &fpga.prog_parser;
+
+    ret = sk_fpga_bit_hash_setup();
+    if (ret)
+        return ret;
+    sk_fpga_bit_init(p);
+    // bitstream is never longer than the file it comes from
+    p->out_cap = size;
+    p->out = vmalloc(p->out_cap);
+    if (!p->out)
         return -ENOMEM;
+    p->hash = fpga.prog_hash;
+    crypto_shash_init(p->hash);
+    ret = sk_fpga_bit_feed(p, data, size);
+    if (!ret)
+        ret = sk_fpga_bit_finish(p);
+    if (ret)
+    {
+        vfree(p->out);
+        p->out = NULL;
     }
     else
     {
-        fs = get_fs();
-        set_fs(get_ds());
-        do
+        crypto_shash_final(p->hash, hash);
+    }
+    p->hash = NULL;
+    return ret;
+}
+
+// Parse a loaded image and keep the bitstream in the cache, name is
+// remembered so SKFPGA_IOSPROGFW can find it without file I/O.
+// Called with ctrl_lock held
+static int sk_fpga_bit_cache_add (const uint8_t* data, size_t size, const char* name, uint8_t* hash)
+{
+    int i = 0;
+    int ret = 0;
+    struct sk_fpga_bit_parser* p = &fpga.prog_parser;
+    struct sk_fpga_bit_cache_entry* e = NULL;
+
+    ret = sk_fpga_bit_parse(data, size, hash);
+    if (ret)
+        return ret;
+
+    // the name may have pointed at other data before
+    e = sk_fpga_bit_cache_find_name(name);
+    if (e)
+        e->name[0] = 0;
+    e = sk_fpga_bit_cache_find(hash);
+    if (e)
+    {
+        strlcpy(e->name, name, PROG_FILE_NAME_LEN);
+        goto free_out;
+    }
+    // take a free entry or evict the least recently used one
+    e = &fpga.bit_cache[0];
+    for (i = 0; i < SK_FPGA_BIT_CACHE_SIZE; i++)
+    {
+        if (!fpga.bit_cache[i].data)
         {
-            len = kernel_read(f, fpga.fpga_prog_buffer, TMP_BUF_SIZE, &off);
-            sk_fpga_program(fpga.fpga_prog_buffer, len);
+            e = &fpga.bit_cache[i];
+            break;
         }
-        while (len);
-        set_fs(fs);
-        filp_close(f, NULL);
+        if (fpga.bit_cache[i].last_use < e->last_use)
+            e = &fpga.bit_cache[i];
+    }
+    vfree(e->data);
+    memcpy(e->hash, hash, SK_FPGA_BIT_HASH_LEN);
+    strlcpy(e->name, name, PROG_FILE_NAME_LEN);
+    e->data = p->out;
+    e->len = p->out_len;
+    e->last_use = ++fpga.bit_cache_clock;
+    p->out = NULL;
+
+free_out:
+    vfree(p->out);
+    p->out = NULL;
+    return ret;
+}
+
+// Load firmware from the firmware search path into the cache, always reads
+// the file so an updated image replaces the cached one.
+// Called with ctrl_lock held
+int sk_fpga_bit_cache_load (const char* name, uint8_t* hash)
+{
+    int ret = 0;
+    const struct firmware* fw = NULL;
+
+    ret = request_firmware(&fw, name, &fpga.pdev->dev);
+    if (ret)
+    {
+        printk(KERN_ALERT "Failed to load firmware: %s", name);
+        return ret;
+    }
+    ret = sk_fpga_bit_cache_add(fw->data, fw->size, name, hash);
+    release_firmware(fw);
+    return ret;
+}
+
+// Finish programming started by probe, runs once the firmware is loaded
+static void sk_fpga_boot_fw_done (const struct firmware* fw, void* context)
+{
+    int ret = -ENOENT;
+    uint8_t hash[SK_FPGA_BIT_HASH_LEN];
+
+    if (fw)
+    {
+        mutex_lock(&fpga.ctrl_lock);
+        // an O_NONBLOCK opener may have started a write() session meanwhile
+        if (fpga.prog_owner)
+            ret = -EBUSY;
+        else
+            ret = sk_fpga_bit_cache_add(fw->data, fw->size, fpga.fw_name, hash);
+        if (!ret)
+            ret = sk_fpga_bit_switch(hash);
+        mutex_unlock(&fpga.ctrl_lock);
+        release_firmware(fw);
+    }
+    if (ret)
+        printk(KERN_ALERT"Failed to program FPGA with %s at boot: %d", fpga.fw_name, ret);
+    WRITE_ONCE(fpga.boot_pending, false);
+    wake_up_all(&fpga.prog_wait);
+}
+
+// Configuration is done and nobody is programming fpga right now
+static bool sk_fpga_ready (void)
+{
+    if (READ_ONCE(fpga.boot_pending) || READ_ONCE(fpga.prog_busy))
+        return false;
+    return gpio_get_value(fpga.fpga_pins.fpga_done);
+}
+
+// Program a cached bitstream, nothing is done if it's running already.
+// Called with ctrl_lock held
+int sk_fpga_bit_switch (const uint8_t* hash)
+{
+    struct sk_fpga_bit_cache_entry* e = NULL;
+
+    if (sk_fpga_bit_running(hash))
+        return 0;
+    e = sk_fpga_bit_cache_find(hash);
+    if (!e)
+        return -ENOENT;
+    e->last_use = ++fpga.bit_cache_clock;
+    return sk_fpga_bit_program(hash, e->data, e->len);
+}
+
+static bool sk_fpga_bit_running (const uint8_t* hash)
+{
+    if (fpga.loaded_valid && !memcmp(fpga.loaded_hash, hash, SK_FPGA_BIT_HASH_LEN) &&
+        gpio_get_value(fpga.fpga_pins.fpga_done))
+    {
+        _DBG("bitstream is loaded already");
+        return true;
     }
+    return false;
+}
+
+// Shift a parsed bitstream out and remember its hash. Called with ctrl_lock held
+static int sk_fpga_bit_program (const uint8_t* hash, const uint8_t* data, uint32_t len)
+{
+    if (sk_fpga_prepare_to_program())
+        return -ENODEV;
+    sk_fpga_program(data, len);
     if (sk_fpga_programming_done())
+        return -EIO;
+    memcpy(fpga.loaded_hash, hash, SK_FPGA_BIT_HASH_LEN);
+    fpga.loaded_valid = true;
+    return 0;
+}
+
+static void sk_fpga_bit_cache_free (void)
+{
+    int i = 0;
+    for (i = 0; i < SK_FPGA_BIT_CACHE_SIZE; i++)
+    {
+        vfree(fpga.bit_cache[i].data);
+        fpga.bit_cache[i].data = NULL;
+    }
+    kfree(fpga.prog_hash);
+    fpga.prog_hash = NULL;
+    if (fpga.prog_tfm)
+        crypto_free_shash(fpga.prog_tfm);
+    fpga.prog_tfm = NULL;
+}
+
+// Program fpga with a firmware from the firmware search path, the bitstream
+// stays cached by name so programming it again costs no file I/O.
+// SKFPGA_IOSBITLOAD refreshes a cached name after the file changed
+int sk_fpga_prog_fw (const char* name)
+{
+    int ret = 0;
+    uint8_t hash[SK_FPGA_BIT_HASH_LEN];
+    struct sk_fpga_bit_cache_entry* e = sk_fpga_bit_cache_find_name(name);
+
+    if (e)
+        return sk_fpga_bit_switch(e->hash);
+    ret = sk_fpga_bit_cache_load(name, hash);
+    if (ret)
+        return ret;
+    return sk_fpga_bit_switch(hash);
+}
+
+// Program fpga with a bitstream file, read on every call since the path is
+// relative to the caller. It's not cached so preloaded firmwares aren't
+// evicted, the hash still skips shifting a running design
+int sk_fpga_prog_file (const char* path)
+{
+    int ret = 0;
+    void* buf = NULL;
+    loff_t size = 0;
+    uint8_t hash[SK_FPGA_BIT_HASH_LEN];
+    struct sk_fpga_bit_parser* p = &fpga.prog_parser;
+
+    ret = kernel_read_file_from_path(path, &buf, &size, 0, READING_FIRMWARE);
+    if (ret)
     {
+        printk(KERN_ALERT "Failed to read bitstream: %s", path);
+        return ret;
+    }
+    ret = sk_fpga_bit_parse(buf, size, hash);
+    vfree(buf);
+    if (ret)
+        return ret;
+    if (!sk_fpga_bit_running(hash))
+        ret = sk_fpga_bit_program(hash, p->out, p->out_len);
+    vfree(p->out);
+    p->out = NULL;
+    return ret;
+}
+
+// Called with ctrl_lock held
+int sk_fpga_prog_session_start (struct sk_fpga_file* ctx)
+{
+    if (fpga.prog_owner)
+        return -EBUSY;
+    if (sk_fpga_prepare_to_program())
         return -ENODEV;
+    sk_fpga_bit_init(&fpga.prog_parser);
+    // hash lets a later switch to the same bitstream be skipped
+    if (!sk_fpga_bit_hash_setup())
+    {
+        fpga.prog_parser.hash = fpga.prog_hash;
+        crypto_shash_init(fpga.prog_parser.hash);
     }
+    fpga.prog_owner = ctx;
+    return 0;
+}
 
+// Called with ctrl_lock held
+int sk_fpga_prog_session_finish (struct sk_fpga_file* ctx)
+{
+    int ret = 0;
+    if (fpga.prog_owner != ctx)
+        return -EPERM;
+    ret = sk_fpga_bit_finish(&fpga.prog_parser);
+    if (sk_fpga_programming_done() && !ret)
+        ret = -EIO;
+    if (!ret && fpga.prog_parser.hash)
+    {
+        crypto_shash_final(fpga.prog_parser.hash, fpga.loaded_hash);
+        fpga.loaded_valid = true;
+    }
+    fpga.prog_parser.hash = NULL;
+    fpga.prog_owner = NULL;
     return ret;
 }
 
+// Shift bits out while the caller fetches the next part of the file
+static ssize_t sk_fpga_write_prog (struct sk_fpga_file* ctx, struct iov_iter* from)
+{
+    int ret = 0;
+    size_t done = 0;
+    size_t len = iov_iter_count(from);
+    uint32_t chunk = 0;
+
+    mutex_lock(&fpga.ctrl_lock);
+    if (fpga.prog_owner != ctx)
+    {
+        ret = -EPERM;
+        goto unlock;
+    }
+    while (done < len)
+    {
+        chunk = min_t(size_t, len - done, TMP_BUF_SIZE);
+        if (copy_from_iter(fpga.fpga_prog_buffer, chunk, from) != chunk)
+        {
+            ret = -EFAULT;
+            break;
+        }
+        ret = sk_fpga_bit_feed(&fpga.prog_parser, fpga.fpga_prog_buffer, chunk);
+        if (ret)
+            break;
+        done += chunk;
+    }
+
+unlock:
+    mutex_unlock(&fpga.ctrl_lock);
+    return done ? done : ret;
+}
+
+// Region is picked by the mmap offset, see SK_FPGA_MMAP_OFFSET, offset within
+// the region selects the first mapped page. Offsets inside region 0 map the
+// region chosen by SKFPGA_IOSADDRSEL.
 static int sk_fpga_mmap (struct file *file, struct vm_area_struct * vma)
 {
-    //NOTE: we should really protect these by mutexes and stuff...
-    // Ignoring pgoff to determine start of mmap
     int ret = 0;
     unsigned long start = 0;
-    unsigned long len   = 0;
-    switch (fpga.fpga_addr_sel)
+    unsigned long size  = 0;
+    unsigned long len   = (vma->vm_end - vma->vm_start);
+    unsigned long off   = (vma->vm_pgoff << PAGE_SHIFT);
+    enum addr_selector sel = off / SK_FPGA_MMAP_REGION_SIZE;
+    struct sk_fpga_file* ctx = file->private_data;
+
+    off %= SK_FPGA_MMAP_REGION_SIZE;
+    if (sel == FPGA_ADDR_UNDEFINED)
+        sel = ctx->addr_sel;
+    switch (sel)
     {
     case FPGA_ADDR_CS0:
-        start = (fpga.fpga_mem_phys_start_cs0 >> PAGE_SHIFT);
+        start = fpga.fpga_mem_phys_start_cs0;
+        size = fpga.fpga_mem_window_size;
         break;
     case FPGA_ADDR_CS1:
-        start = (fpga.fpga_mem_phys_start_cs1 >> PAGE_SHIFT);
+        start = fpga.fpga_mem_phys_start_cs1;
+        size = fpga.fpga_mem_window_size;
         break;
+    case FPGA_ADDR_CAPTURE:
+        ret = sk_fpga_mmap_capture(vma, off);
+        trace_sk_fpga_mmap(sel, off, len, ret);
+        return ret;
+    case FPGA_ADDR_STATUS:
+        ret = sk_fpga_mmap_status(vma, off);
+        trace_sk_fpga_mmap(sel, off, len, ret);
+        return ret;
     case FPGA_ADDR_DMA:
         BUG_ON(fpga.dma_addr_buf & (PAGE_SIZE - 1));
-        start = (fpga.dma_addr_buf >> PAGE_SHIFT);
+        start = fpga.dma_addr_buf;
+        size = DMA_BUF_SIZE;
         break;
     default:
         printk(KERN_ALERT"Wrong address space selector");
-        BUG_ON(1);
-        break;
-    }
-    // (vm_end - vm_start) should be equal to window size
-    len = (vma->vm_end - vma->vm_start);
-    BUG_ON(vma->vm_pgoff);
-    if (fpga.fpga_addr_sel == FPGA_ADDR_DMA)
-    {
-        BUG_ON(DMA_BUF_SIZE != (vma->vm_end - vma->vm_start));
-    }
-    else
-    {
-        BUG_ON(fpga.fpga_mem_window_size != (vma->vm_end - vma->vm_start));
+        return -EINVAL;
     }
+    // any page aligned part of the region may be mapped
+    if ((off >= size) || (len > size - off))
+        return -EINVAL;
 
     // mark these pages as IO
     vma->vm_page_prot = vm_get_page_prot(vma->vm_flags | VM_IO);
 
     //io_remap_pfn_range call...
-    ret = io_remap_pfn_range(vma, vma->vm_start, start, len, vma->vm_page_prot);
+    ret = io_remap_pfn_range(vma, vma->vm_start, (start + off) >> PAGE_SHIFT, len, vma->vm_page_prot);
+    trace_sk_fpga_mmap(sel, off, len, ret);
     if (ret) 
     {
         printk(KERN_ALERT"fpga mmap failed :(\n");
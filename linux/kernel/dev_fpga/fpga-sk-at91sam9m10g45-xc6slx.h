@@ -21,6 +21,20 @@
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/firmware.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <crypto/hash.h>
 
 #include <linux/kernel.h>
 #include <linux/time.h>
@@ -53,6 +67,16 @@
 #define EBICSA_OFFSET 0x128
 #define EBICSA_CS1_MASK (1 << 1)
 
+// PIO controllers, one bank of 32 gpios each starting from PIOA
+#define PIO_ADDRESS 0xFFFFF200
+#define PIO_BANK_WINDOW 0x200
+#define PIO_BANK_NUM 5
+#define PIO_SODR 0x30
+#define PIO_CODR 0x34
+#define PIO_ODSR 0x38
+#define PIO_OWER 0xA0
+#define PIO_OWDR 0xA4
+
 #define SMC_ADDRESS 0xFFFFE800
 #define SMC_ADDRESS_WINDOW 0xff
 #define SMC_SETUP(addr, num) (addr + (0x10/sizeof(uint32_t) * num) + 0x00/sizeof(uint32_t))
@@ -78,12 +102,42 @@
 # define _DBG(fmt, args...) do { } while(0);
 #endif
 
-#define DEBUG
-
 #define TMP_BUF_SIZE 4096
 #define DMA_BUF_SIZE 65536
+// every addr_selector gets its own mmap region, region 0 follows SKFPGA_IOSADDRSEL
+#define SK_FPGA_MMAP_REGION_SIZE (64 << 20)
+#define SK_FPGA_MMAP_OFFSET(sel) ((sel) * SK_FPGA_MMAP_REGION_SIZE)
 #define PROG_FILE_NAME_LEN 256
 #define MAX_WAIT_COUNTER 8*2048
+#define SK_FPGA_BATCH_MAX 512
+#define SK_FPGA_CMD_MAX 256
+#define SK_FPGA_CMD_MAX_TIMEOUT_US 1000000 // upper bound for wait/delay commands
+#define SK_FPGA_CMD_SPIN_US 50             // busy poll that long before sleeping between polls
+#define SK_FPGA_DMA_RING_SIZE 64           // completions queued per file, in-flight transfers included
+#define SK_FPGA_DMA_USER_BUFS 16           // user buffers registered per file
+#define SK_FPGA_DMA_USER_BUF_MAX (64 << 20) // max size of a registered user buffer
+#define SK_FPGA_CAPTURE_MAX (2 << 20)      // max size of the capture ring
+#define SK_FPGA_PROG_VERIFY_LEN 64         // bitstream bytes replayed by waveform verification
+#define SK_FPGA_BIT_CACHE_SIZE 4           // bitstreams kept in kernel memory
+#define SK_FPGA_BIT_HASH_LEN 32            // sha256 of the bitstream without .bit header
+#define SK_FPGA_SYNC_WORD 0xAA995566       // starts configuration packets
+#define SK_FPGA_REG_MFWR 0x1B              // multi frame write register, used by compressed bitstreams
+#define SK_FPGA_STARTUP_CCLKS 16           // cclks after DONE to finish startup, covers DONE_cycle..GWE_cycle and DonePipe
+#define SK_FPGA_DMA_CAL_MIN 64             // smallest transfer timed by the PIO/DMA calibration
+#define SK_FPGA_DMA_CAL_RUNS 3             // best of that many runs is taken per size
+#define SK_FPGA_DMA_TIMEOUT_MS 1000        // data path dma transfer timeout
+// irq registers at the start of cs0
+#define SK_FPGA_REG_IRQ_STATUS 0x0         // pending sources, write 1 to clear
+#define SK_FPGA_REG_IRQ_EVENTS 0x2         // events since the last ack, write subtracts
+#define SK_FPGA_REG_IRQ_COUNT 0x4          // irq is raised once that many events are pending
+#define SK_FPGA_REG_IRQ_TIME 0x6           // or once the oldest one is that many x256 fpga clocks old, 0 is off
+#define SK_FPGA_REG_IRQ_RAISE 0x8          // any write is a software event
+#define SK_FPGA_IRQ_SOURCES 16             // bits in the status register
+#define SK_FPGA_IRQ_TIME_SHIFT 8
+#define SK_FPGA_IRQ_RATE_WINDOW_MS 10      // irq and event rates are measured over that long
+#define SK_FPGA_IRQ_POLL_MIN_US 10         // shortest irq poll period
+#define SK_FPGA_LAT_SUB_BITS 2             // latency buckets per power of 2 is 1 << that
+#define SK_FPGA_LAT_BUCKETS ((64 - SK_FPGA_LAT_SUB_BITS + 1) << SK_FPGA_LAT_SUB_BITS)
 
 enum addr_selector
 {
@@ -91,9 +145,63 @@ enum addr_selector
     FPGA_ADDR_CS0,
     FPGA_ADDR_CS1,
     FPGA_ADDR_DMA,
+    FPGA_ADDR_CAPTURE, // capture header page followed by the capture ring
+    FPGA_ADDR_STATUS,  // read-only struct sk_fpga_status page, mmap() only
     FPGA_ADDR_LAST,
 };
 
+// defines what read() and poll() report for the opened file
+enum sk_fpga_file_mode
+{
+    SK_FPGA_MODE_DATA = 0, // read() accesses fpga memory
+    SK_FPGA_MODE_IRQ,      // read() returns number of fpga irqs since last read, eventfd style
+    SK_FPGA_MODE_DMA,      // read() returns array of struct sk_fpga_dma_completion
+    SK_FPGA_MODE_CAPTURE,  // read() returns captured data, blocks till a period completes
+    SK_FPGA_MODE_PROG,     // write() feeds the bitstream of the programming session
+    SK_FPGA_MODE_LAST,
+};
+
+enum sk_fpga_irq_poll_mode
+{
+    SK_FPGA_IRQ_POLL_OFF = 0,  // interrupt per batch of events only
+    SK_FPGA_IRQ_POLL_ADAPTIVE, // poll from hrtimer while the interrupt rate is high
+    SK_FPGA_IRQ_POLL_ALWAYS,   // poll from hrtimer, interrupt stays masked
+    SK_FPGA_IRQ_POLL_LAST,
+};
+
+// latencies kept in debugfs histograms
+enum sk_fpga_lat
+{
+    SK_FPGA_LAT_IRQ_THREAD = 0, // irq edge to irq thread
+    SK_FPGA_LAT_IRQ_READ,       // irq edge or poll to read() returning the events
+    SK_FPGA_LAT_DMA,            // SKFPGA_IOSDMA submit to callback
+    SK_FPGA_LAT_DMA_ASYNC,      // SKFPGA_IOSDMASUBMIT submit to completion
+    SK_FPGA_LAT_LAST,
+};
+
+// counters in the stats group of the misc device, every *_OPS is followed by its *_BYTES
+enum sk_fpga_stat
+{
+    SK_FPGA_STAT_IOCTL_OPS = 0,     // SKFPGA_IOSDATA and SKFPGA_IOGDATA
+    SK_FPGA_STAT_IOCTL_BYTES,
+    SK_FPGA_STAT_READ_OPS,          // data read(), dma driven ones included
+    SK_FPGA_STAT_READ_BYTES,
+    SK_FPGA_STAT_WRITE_OPS,
+    SK_FPGA_STAT_WRITE_BYTES,
+    SK_FPGA_STAT_DMA_TO_FPGA_OPS,   // completed transfers of every dma path
+    SK_FPGA_STAT_DMA_TO_FPGA_BYTES,
+    SK_FPGA_STAT_DMA_TO_ARM_OPS,
+    SK_FPGA_STAT_DMA_TO_ARM_BYTES,
+    SK_FPGA_STAT_DMA_ERRORS,
+    SK_FPGA_STAT_IRQS,              // rising edges seen by the hard handler
+    SK_FPGA_STAT_PROG_RUNS,
+    SK_FPGA_STAT_PROG_NS,           // prepare to DONE and startup clocks
+    SK_FPGA_STAT_BUSY_NS,           // time spent in data accesses, dma and programming
+    SK_FPGA_STAT_LAST,
+};
+
+#define SK_FPGA_STAT_DMA_OPS(dir) (((dir) == DMA_ARM_TO_FPGA) ? SK_FPGA_STAT_DMA_TO_FPGA_OPS : SK_FPGA_STAT_DMA_TO_ARM_OPS)
+
 enum dma_dir
 {
     DMA_ARM_TO_FPGA,
@@ -109,6 +217,74 @@ struct sk_fpga_dma_transaction
     uint8_t  sync;
 };
 
+// asynchronous transfer between fpga memory and a part of the dma buffer
+struct sk_fpga_dma_request
+{
+    uint32_t addr;       // fpga phys address
+    uint32_t buf_offset; // offset inside the dma buffer
+    uint32_t len;
+    uint8_t  dir;
+    uint32_t cookie;     // filled by the driver on submit
+    uint32_t buf_id;     // 0 for the dma buffer, otherwise id of a registered user buffer
+};
+
+// user memory pinned and mapped once to be used by many transfers
+struct sk_fpga_dma_buf
+{
+    void __user* addr;
+    uint32_t len;
+    uint32_t id;         // filled by the driver on register
+};
+
+struct sk_fpga_dma_completion
+{
+    uint32_t cookie;
+    int32_t  status;     // 0 or negative error code
+};
+
+struct sk_fpga_dma_reap
+{
+    struct sk_fpga_dma_completion __user* completions;
+    uint32_t max;        // capacity of completions
+    uint32_t min;        // block until that many completions are available
+    uint32_t num;        // filled with number of reaped completions
+};
+
+// continuous capture from an fpga data port into a ring of periods
+struct sk_fpga_capture_config
+{
+    uint32_t addr;       // fpga phys address of the data port
+    uint32_t period_len; // bytes per period
+    uint32_t periods;    // number of periods in the ring
+};
+
+// first page of the capture mapping, indexes are free running period counters
+struct sk_fpga_capture_header
+{
+    uint32_t producer;   // periods filled by DMA
+    uint32_t consumer;   // periods consumed, may be advanced by an mmap reader
+    uint32_t period_len;
+    uint32_t periods;
+    uint32_t overruns;   // periods overwritten before being consumed
+    uint32_t running;
+};
+
+// Status page, copy it out while seq is even and stays the same, changes aren't signalled,
+// poll() an irq mode file to wait for events
+struct sk_fpga_status
+{
+    uint32_t seq;            // odd while the page is being updated
+    uint32_t irq_count;      // fpga irq events since probe
+    uint64_t irq_stamp_ns;   // CLOCK_MONOTONIC of the edge or poll which brought the latest events
+    uint32_t dma_submitted;  // SKFPGA_IOSDMA and SKFPGA_IOSDMASUBMIT transfers
+    uint32_t dma_completed;
+    uint32_t prog_state;     // enum sk_fpga_prog_state
+    uint8_t  reset;          // pin levels
+    uint8_t  host_irq;
+    uint8_t  fpga_irq;
+    uint8_t  reserved;
+};
+
 struct sk_fpga_smc_timings
 {
     uint32_t setup; // setup ebi timings
@@ -124,6 +300,57 @@ struct sk_fpga_data
     uint16_t data;
 };
 
+enum sk_fpga_op
+{
+    SK_FPGA_OP_READ = 0, // read short from address into data
+    SK_FPGA_OP_WRITE,    // write data as short to address
+    SK_FPGA_OP_LAST,
+};
+
+struct sk_fpga_batch_entry
+{
+    uint32_t address;
+    uint16_t data;
+    uint8_t  op;
+};
+
+// entries are executed in order, read results are returned in place
+struct sk_fpga_batch
+{
+    struct sk_fpga_batch_entry __user* entries;
+    uint32_t num;
+};
+
+enum sk_fpga_cmd_op
+{
+    SK_FPGA_CMD_READ = 0, // result = read(address)
+    SK_FPGA_CMD_WRITE,    // write(address, data)
+    SK_FPGA_CMD_RMW,      // write(address, (read(address) & ~mask) | (data & mask)), result = new value
+    SK_FPGA_CMD_WAIT,     // poll until (read(address) & mask) == data or arg us elapsed, result = last value
+    SK_FPGA_CMD_DELAY,    // delay for arg us, a fatal signal fails it with -EINTR
+    SK_FPGA_CMD_HOST_IRQ, // set host irq pin to data
+    SK_FPGA_CMD_RESET,    // set reset pin to data
+    SK_FPGA_CMD_LAST,
+};
+
+struct sk_fpga_cmd
+{
+    uint32_t address;
+    uint32_t arg;     // timeout for wait or delay in us
+    uint16_t data;
+    uint16_t mask;
+    uint8_t  op;
+};
+
+// commands are executed back-to-back, execution stops at the first failure
+struct sk_fpga_cmd_list
+{
+    struct sk_fpga_cmd __user* cmds;
+    uint16_t __user* results; // one result per command, may be NULL
+    uint32_t num;
+    int32_t  failed;          // index of the failed command or -1
+};
+
 struct sk_fpga_pins
 {
     uint8_t fpga_cclk;                // pin to run cclk on fpga
@@ -135,6 +362,162 @@ struct sk_fpga_pins
     uint8_t host_irq;                 // pin to trigger irq on fpga side
 };
 
+// slave serial engines shifting the bitstream into fpga
+enum sk_fpga_prog_engine
+{
+    SK_FPGA_PROG_GPIO = 0, // gpiolib call per pin change
+    SK_FPGA_PROG_PIO,      // precomputed ODSR writes, din and cclk must share a PIO bank
+    SK_FPGA_PROG_LAST,
+};
+
+enum sk_fpga_prog_state
+{
+    SK_FPGA_PROG_STATE_NONE = 0, // not programmed since probe
+    SK_FPGA_PROG_STATE_BUSY,
+    SK_FPGA_PROG_STATE_DONE,
+    SK_FPGA_PROG_STATE_FAILED,
+};
+
+// Xilinx .bit file is a sequence of fields followed by the raw bitstream:
+// 0x0009, 9 bytes, 0x0001, then keys 'a'-'d' with 16 bit length and a string,
+// key 'e' with 32 bit length and the bitstream. Lengths are big endian.
+enum sk_fpga_bit_state
+{
+    SK_FPGA_BIT_DETECT = 0, // first 2 bytes tell .bit from raw bitstream
+    SK_FPGA_BIT_HDR,        // 9 bytes of the first field
+    SK_FPGA_BIT_HDR_END,    // 0x0001 before the first key
+    SK_FPGA_BIT_KEY,
+    SK_FPGA_BIT_FIELD_LEN,
+    SK_FPGA_BIT_FIELD,
+    SK_FPGA_BIT_DATA_LEN,
+    SK_FPGA_BIT_DATA,       // bitstream with known length
+    SK_FPGA_BIT_RAW,        // no header, everything is bitstream
+    SK_FPGA_BIT_DONE,       // bytes after the bitstream are dropped
+};
+
+struct sk_fpga_bit_parser
+{
+    enum sk_fpga_bit_state state;
+    uint32_t acc;       // big endian number being collected
+    uint32_t need;      // bytes left in the current number or field
+    uint32_t data_left; // bitstream bytes left
+    uint8_t  key;
+    char     design[64]; // design name from field 'a'
+    uint32_t design_len;
+    struct shash_desc* hash; // hashes the bitstream if not NULL
+    uint8_t* out;        // bitstream is collected here instead of being shifted out if not NULL
+    uint32_t out_len;
+    uint32_t out_cap;
+    // configuration packets are scanned as 16 bit words once sync word is seen
+    uint32_t offset;     // bitstream bytes seen
+    uint32_t sync;       // last 4 bytes before sync
+    uint32_t sync_offset; // offset of the first packet, 0 till sync word is seen
+    uint32_t skip;       // packet payload words to skip
+    uint8_t  count_words; // type 2 word count words to collect
+    bool     half;       // first byte of a word is in word
+    uint16_t word;
+    bool     compressed; // MFWR packets found
+};
+
+// preloaded bitstream ready to be shifted out without any file I/O
+struct sk_fpga_bit_cache_entry
+{
+    uint8_t  hash[SK_FPGA_BIT_HASH_LEN];
+    char     name[PROG_FILE_NAME_LEN]; // firmware it was loaded from, empty for none
+    uint8_t* data;       // bitstream without .bit header, NULL for a free entry
+    uint32_t len;
+    uint32_t last_use;   // least recently used entry is evicted first
+};
+
+// identifies a bitstream for the cache ioctls
+struct sk_fpga_bitstream
+{
+    char    name[PROG_FILE_NAME_LEN]; // firmware name, used by SKFPGA_IOSBITLOAD only
+    uint8_t hash[SK_FPGA_BIT_HASH_LEN];
+};
+
+// fpga raises its irq once count events are pending or the oldest one waits for time_us
+struct sk_fpga_irq_coalesce
+{
+    uint16_t count;   // 0 and 1 raise irq on every event
+    uint32_t time_us; // 0 is off
+};
+
+// read() in SK_FPGA_MODE_IRQ with at least that much room
+struct sk_fpga_irq_info
+{
+    uint32_t events;  // events since the last read
+    uint32_t sources; // status bits seen since the last read
+};
+
+// pinned and mapped user memory
+struct sk_fpga_user_buf
+{
+    struct page** pages;
+    int npages;
+    struct sg_table sgt;
+    int nents;                    // number of dma mapped segments
+    uint32_t len;
+    atomic_t busy;                // transfers using the buffer
+};
+
+// per open file state
+struct sk_fpga_file
+{
+    enum sk_fpga_file_mode mode;
+    enum addr_selector addr_sel; // window used by data accesses and mmap(), file position is an offset in it
+    uint32_t irq_seen; // irq counter value consumed by this file
+    uint32_t irq_src_seen[SK_FPGA_IRQ_SOURCES]; // same for every irq source
+
+    spinlock_t dma_lock;          // protects completion ring
+    struct sk_fpga_dma_completion dma_ring[SK_FPGA_DMA_RING_SIZE];
+    uint32_t dma_head;            // next completion to be reaped
+    uint32_t dma_tail;            // next free slot
+    atomic_t dma_inflight;        // submitted but not completed transfers
+    wait_queue_head_t dma_wait;   // woken up on every completion
+
+    struct mutex user_bufs_lock;  // protects user_bufs
+    struct sk_fpga_user_buf* user_bufs[SK_FPGA_DMA_USER_BUFS];
+};
+
+// in-flight asynchronous transfer, may consist of several descriptors
+struct sk_fpga_dma_req
+{
+    struct sk_fpga_file* ctx;
+    uint32_t cookie;
+    atomic_t pending;             // descriptors not yet completed
+    int status;
+    struct sk_fpga_user_buf* buf; // NULL for the dma buffer
+    uint32_t offset;
+    uint32_t len;
+    uint8_t  dir;
+    s64 submit_ns;                // for latency histogram
+};
+
+// log-linear histogram of latencies in ns
+struct sk_fpga_lat_hist
+{
+    spinlock_t lock;
+    uint32_t buckets[SK_FPGA_LAT_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+// one copy per cpu, indexed by enum sk_fpga_stat
+struct sk_fpga_stats
+{
+    uint64_t val[SK_FPGA_STAT_LAST];
+};
+
+// sysfs attribute showing the sum of one counter
+struct sk_fpga_stat_attr
+{
+    struct device_attribute attr;
+    enum sk_fpga_stat stat;
+};
+
 struct sk_fpga
 {
     struct platform_device *pdev;
@@ -144,20 +527,81 @@ struct sk_fpga
     uint32_t fpga_mem_phys_start_cs1; // phys mapped addr of fpga mem on cs1
     uint16_t __iomem* fpga_mem_virt_start_cs0;// virt mapped addr of fpga mem on cs0
     uint16_t __iomem* fpga_mem_virt_start_cs1;// virt mapped addr of fpga mem on cs1
-    uint8_t opened;                   // fpga opened times
+    atomic_t opened;                  // fpga opened times
     struct sk_fpga_smc_timings smc_timings; // holds timings for ebi
     struct sk_fpga_pins        fpga_pins; // pins to be used to programm fpga or interact with it
     uint8_t* fpga_prog_buffer; // tmp buffer to hold fpga firmware
-    uint32_t address;
     struct clk* fpga_clk;
     uint32_t    fpga_freq;
-    enum addr_selector fpga_addr_sel;
+    spinlock_t  bus_lock;             // serializes accesses to fpga windows
+    struct mutex ctrl_lock;           // serializes programming, smc setup, irq setup and legacy dma
+    enum sk_fpga_prog_engine prog_engine; // engine used by the current programming
+    void __iomem* prog_pio;           // PIO bank with din and cclk
+    uint32_t prog_din_mask;
+    uint32_t prog_cclk_mask;
+    uint32_t* prog_seq;               // ODSR values per byte, 2 per bit
+    bool prog_verified;               // waveforms compared for the current programming
+    struct sk_fpga_file* prog_owner;  // file running a write() programming session
+    struct sk_fpga_bit_parser prog_parser;
+    struct crypto_shash* prog_tfm;    // sha256, allocated on first use
+    struct shash_desc* prog_hash;
+    struct sk_fpga_bit_cache_entry bit_cache[SK_FPGA_BIT_CACHE_SIZE];
+    uint32_t bit_cache_clock;
+    uint8_t loaded_hash[SK_FPGA_BIT_HASH_LEN]; // bitstream running in fpga
+    bool loaded_valid;                // loaded_hash is known and fpga wasn't reprogrammed since
+    const char* fw_name;              // firmware programmed at probe, from dts, may be NULL
+    bool boot_pending;                // programming started by probe isn't finished yet
+    bool prog_busy;                   // programming pins are taken
+    wait_queue_head_t prog_wait;      // woken up when programming is finished
 
     struct dma_chan* fpga_dma_chan;
     dma_addr_t  dma_addr_buf;
     void*       dma_buf;
+    dma_addr_t  bounce_addr_buf;
+    void*       bounce_buf;           // data read()/write() dma buffer, dma_buf is the user one
+    int dma_threshold_measured;       // latest measured dma_threshold, -1 for none
+    struct mutex dma_chan_lock;       // serializes transfer setup on fpga_dma_chan, protects bounce_buf
+    atomic_t dma_async_active;        // SKFPGA_IOSDMASUBMIT transfers in flight, all files
+    atomic_t dma_legacy_busy;         // SKFPGA_IOSDMA transfer in flight, it owns dma_submit_*
     int pid;
     int irq_num;
+    atomic_t irq_count;               // number of fpga irq events since probe
+    atomic_t irq_src_count[SK_FPGA_IRQ_SOURCES]; // interrupts every source took part in
+    struct sk_fpga_irq_coalesce irq_coalesce;    // reapplied every time fpga is programmed,
+    bool irq_coalesce_set;                       // once SKFPGA_IOSIRQCOALESCE has set it
+    bool irq_polling;                 // irq is masked, irq_poll_timer acks events
+    struct hrtimer irq_poll_timer;
+    s64 irq_rate_start;               // start of the current rate window, ns
+    uint32_t irq_rate_num;            // irqs or, while polling, events in the window
+    s64 irq_edge_ns;                  // rising edge seen by the hard handler
+    atomic64_t irq_stamp_ns;          // edge or poll which brought the latest events
+    s64 dma_submit_ns;                // latest SKFPGA_IOSDMA submit
+    struct sk_fpga_dma_transaction dma_submit_tran; // and its transfer with cookie, for tracing
+    int dma_submit_cookie;            // taken from dma_cookie, known before the callback can run
+    struct sk_fpga_lat_hist lat[SK_FPGA_LAT_LAST];
+    struct dentry* debugfs;
+    struct sk_fpga_stats __percpu* stats; // written lock-free on the local cpu, summed on show
+    s64 prog_start_ns;                // latest sk_fpga_prepare_to_program()
+    atomic_t dma_cookie;              // last cookie given to an asynchronous transfer
+
+    struct mutex capture_lock;        // protects capture setup and ring reads
+    spinlock_t capture_idx_lock;      // protects producer/consumer updates
+    struct sk_fpga_capture_header* capture_hdr; // page shared with user
+    struct sk_fpga_status* status;    // read-only page shared with user, coherent memory
+    dma_addr_t status_addr;
+    spinlock_t status_lock;           // serializes status page writers
+    enum sk_fpga_prog_state prog_state;
+    void*       capture_buf;          // capture ring
+    dma_addr_t  capture_addr_buf;
+    uint32_t    capture_size;         // size of the allocated ring
+    uint32_t    capture_period_len;
+    uint32_t    capture_periods;
+    uint32_t    capture_read_off;     // offset of read() inside the consumer period
+    bool        capture_running;
+    struct sk_fpga_file* capture_owner; // file which started capture
+    atomic_t    capture_maps;         // mappings of the capture ring
+    wait_queue_head_t capture_wait;   // woken up on every period
+    wait_queue_head_t irq_wait;       // woken up on every fpga irq
 
 };
 
@@ -166,11 +610,11 @@ static int     sk_fpga_remove (struct platform_device *pdev);
 static int     sk_fpga_probe  (struct platform_device *pdev);
 static int     sk_fpga_close  (struct inode *inodep, struct file *filp);
 static int     sk_fpga_open   (struct inode *inode, struct file *file);
-static ssize_t sk_fpga_write  (struct file *file, const char __user *buf,
-                               size_t len, loff_t *ppos);
-static ssize_t sk_fpga_read   (struct file *file, char __user *buf,
-                               size_t len, loff_t *ppos);
+static ssize_t sk_fpga_write_iter (struct kiocb *iocb, struct iov_iter *from);
+static ssize_t sk_fpga_read_iter  (struct kiocb *iocb, struct iov_iter *to);
+static loff_t  sk_fpga_llseek (struct file *file, loff_t offset, int whence);
 static long    sk_fpga_ioctl  (struct file *f, unsigned int cmd, unsigned long arg);
+static unsigned int sk_fpga_poll (struct file *file, poll_table *wait);
 int            sk_fpga_setup_ebicsa (void);
 int            sk_fpga_setup_smc (void);
 int            sk_fpga_read_smc (void);
@@ -178,15 +622,72 @@ int            sk_fpga_read_smc (void);
 int sk_fpga_prepare_to_program (void);
 int sk_fpga_programming_done   (void);
 void sk_fpga_program (const uint8_t* buff, uint32_t bufLen);
-int sk_fpga_prog(char* fName);
+static int sk_fpga_prog_pio_setup (void);
+static void sk_fpga_prog_pio_release (void);
+static int sk_fpga_prog_verify (const uint8_t* buff, uint32_t bufLen);
+int sk_fpga_prog_fw (const char* name);
+int sk_fpga_prog_file (const char* path);
+static void sk_fpga_bit_init (struct sk_fpga_bit_parser* p);
+static int sk_fpga_bit_feed (struct sk_fpga_bit_parser* p, const uint8_t* buf, uint32_t len);
+static int sk_fpga_bit_finish (struct sk_fpga_bit_parser* p);
+static int sk_fpga_bit_hash_setup (void);
+int sk_fpga_bit_cache_load (const char* name, uint8_t* hash);
+int sk_fpga_bit_switch (const uint8_t* hash);
+static void sk_fpga_bit_cache_free (void);
+static int sk_fpga_bit_parse (const uint8_t* data, size_t size, uint8_t* hash);
+static int sk_fpga_bit_cache_add (const uint8_t* data, size_t size, const char* name, uint8_t* hash);
+static bool sk_fpga_bit_running (const uint8_t* hash);
+static int sk_fpga_bit_program (const uint8_t* hash, const uint8_t* data, uint32_t len);
+static void sk_fpga_boot_fw_done (const struct firmware* fw, void* context);
+static bool sk_fpga_ready (void);
+int sk_fpga_prog_session_start (struct sk_fpga_file* ctx);
+int sk_fpga_prog_session_finish (struct sk_fpga_file* ctx);
+static ssize_t sk_fpga_write_prog (struct sk_fpga_file* ctx, struct iov_iter* from);
 static int sk_fpga_mmap (struct file *file, struct vm_area_struct * vma);
 int sk_fpga_setup_dma (struct platform_device *pdev);
 int sk_fpga_dma_config_slave (void);
+static int sk_fpga_dma_bounce (uint32_t addr, uint32_t len, enum dma_dir dir);
+static ssize_t sk_fpga_data_pio (struct sk_fpga_file* ctx, struct iov_iter* iter, loff_t pos,
+                                 size_t total, enum dma_dir dir);
+static ssize_t sk_fpga_data_dma (struct sk_fpga_file* ctx, struct iov_iter* iter, loff_t pos,
+                                 size_t total, enum dma_dir dir);
+static bool sk_fpga_data_use_dma (size_t len);
+static bool sk_fpga_dma_chan_busy (void);
+static void sk_fpga_dma_calibrate (void);
+static void sk_fpga_dma_recalibrate (void);
+int sk_fpga_do_batch (struct sk_fpga_file* ctx, struct sk_fpga_batch* batch);
+int sk_fpga_do_cmd_list (struct sk_fpga_file* ctx, struct sk_fpga_cmd_list* list);
 int sk_fpga_do_dma_transfer (struct sk_fpga_dma_transaction* tran);
 void sk_fpga_dma_callback (void);
+int sk_fpga_dma_submit (struct sk_fpga_file* ctx, struct sk_fpga_dma_request* req);
+int sk_fpga_dma_reap (struct sk_fpga_file* ctx, struct iov_iter* to,
+                      uint32_t max, uint32_t min, bool nonblock);
+int sk_fpga_dma_buf_register (struct sk_fpga_file* ctx, struct sk_fpga_dma_buf* reg);
+int sk_fpga_dma_buf_unregister (struct sk_fpga_file* ctx, uint32_t id);
+int sk_fpga_capture_start (struct sk_fpga_file* ctx, struct sk_fpga_capture_config* cfg);
+static int sk_fpga_capture_setup (struct sk_fpga_file* ctx, struct sk_fpga_capture_config* cfg);
+int sk_fpga_capture_stop (void);
+static int sk_fpga_mmap_capture (struct vm_area_struct* vma, unsigned long off);
+static struct sk_fpga_user_buf* sk_fpga_user_buf_get (struct sk_fpga_file* ctx, uint32_t id);
+static void sk_fpga_user_buf_release (struct sk_fpga_user_buf* ub);
+static void sk_fpga_user_buf_sync (struct sk_fpga_user_buf* ub, uint32_t offset, uint32_t len, bool for_cpu);
 int sk_fpga_unregister_irq (void);
 int sk_fpga_register_irq (void);
 irqreturn_t sk_fpga_irq_handler (int irq, void *dev_id);
+static irqreturn_t sk_fpga_irq_thread (int irq, void *dev_id);
+static void sk_fpga_irq_coalesce_apply (void);
+static uint32_t sk_fpga_irq_ack (uint32_t budget);
+static s64 sk_fpga_irq_rate (uint32_t num);
+static void sk_fpga_irq_poll_start (void);
+static enum hrtimer_restart sk_fpga_irq_poll (struct hrtimer* timer);
+static void sk_fpga_lat_add (enum sk_fpga_lat which, s64 ns);
+static void sk_fpga_lat_reset (void);
+static void sk_fpga_debugfs_init (void);
+static void sk_fpga_stat_add (enum sk_fpga_stat stat, uint64_t val);
+static void sk_fpga_stat_op (enum sk_fpga_stat ops, uint64_t bytes, s64 busy_ns);
+static ssize_t sk_fpga_stat_show (struct device* dev, struct device_attribute* attr, char* buf);
+static void sk_fpga_status_update (uint32_t dma_submitted, uint32_t dma_completed);
+static int sk_fpga_mmap_status (struct vm_area_struct* vma, unsigned long off);
 
 
 
@@ -199,7 +700,7 @@ irqreturn_t sk_fpga_irq_handler (int irq, void *dev_id);
 #define SKFPGA_IOSSMCTIMINGS _IOW(SKFP_IOC_MAGIC, 3, struct sk_fpga_smc_timings)
 // ioctl to request SMC timings
 #define SKFPGA_IOGSMCTIMINGS _IOR(SKFP_IOC_MAGIC, 4, struct sk_fpga_smc_timings)
-// ioctl to programm FPGA
+// ioctl to programm FPGA with a bitstream file, the path is opened by the kernel
 #define SKFPGA_IOSPROG _IOR(SKFP_IOC_MAGIC, 5, char[PROG_FILE_NAME_LEN])
 // ioctl to set reset pin level
 #define SKFPGA_IOSRESET _IOR(SKFP_IOC_MAGIC, 6, uint8_t)
@@ -216,10 +717,42 @@ irqreturn_t sk_fpga_irq_handler (int irq, void *dev_id);
 #define SKFPGA_IOSADDRSEL _IOR(SKFP_IOC_MAGIC, 12, uint8_t)
 // ioctl to get address space selector
 #define SKFPGA_IOGADDRSEL _IOR(SKFP_IOC_MAGIC, 13, uint8_t)
-// ioctl to start DMA transaction
+// ioctl to start DMA transaction, EBUSY while other transfers use the channel
 #define SKFPGA_IOSDMA _IOR(SKFP_IOC_MAGIC, 14, struct sk_fpga_dma_transaction)
 // ioctl to set pid
 #define SKFPGA_IOSPID _IOR(SKFP_IOC_MAGIC, 15, int)
+// ioctl to perform a batch of reads/writes in one call
+#define SKFPGA_IOSBATCH _IOWR(SKFP_IOC_MAGIC, 16, struct sk_fpga_batch)
+// ioctl to run a list of commands in one call
+#define SKFPGA_IOSCMDLIST _IOWR(SKFP_IOC_MAGIC, 17, struct sk_fpga_cmd_list)
+// ioctl to set what read() and poll() report for the file
+#define SKFPGA_IOSFILEMODE _IOR(SKFP_IOC_MAGIC, 18, uint8_t)
+// ioctl to queue an asynchronous DMA transfer, returns cookie
+#define SKFPGA_IOSDMASUBMIT _IOWR(SKFP_IOC_MAGIC, 19, struct sk_fpga_dma_request)
+// ioctl to reap completed asynchronous DMA transfers
+#define SKFPGA_IOGDMACOMPL _IOWR(SKFP_IOC_MAGIC, 20, struct sk_fpga_dma_reap)
+// ioctl to pin user memory for DMA, returns buffer id
+#define SKFPGA_IOSDMABUFREG _IOWR(SKFP_IOC_MAGIC, 21, struct sk_fpga_dma_buf)
+// ioctl to release user memory pinned for DMA
+#define SKFPGA_IOSDMABUFUNREG _IOR(SKFP_IOC_MAGIC, 22, uint32_t)
+// ioctl to start continuous capture into the capture ring
+#define SKFPGA_IOSCAPTURESTART _IOR(SKFP_IOC_MAGIC, 23, struct sk_fpga_capture_config)
+// ioctl to stop continuous capture
+#define SKFPGA_IOSCAPTURESTOP _IO(SKFP_IOC_MAGIC, 24)
+// ioctl to start a programming session fed by write() in SK_FPGA_MODE_PROG
+#define SKFPGA_IOSPROGSTART _IO(SKFP_IOC_MAGIC, 25)
+// ioctl to finish the programming session, fails if fpga didn't report done
+#define SKFPGA_IOSPROGFINISH _IO(SKFP_IOC_MAGIC, 26)
+// ioctl to load a firmware into the bitstream cache, returns its hash, EBUSY during a write() session
+#define SKFPGA_IOSBITLOAD _IOWR(SKFP_IOC_MAGIC, 27, struct sk_fpga_bitstream)
+// ioctl to program a cached bitstream by hash, no-op if it's already running
+#define SKFPGA_IOSBITSWITCH _IOR(SKFP_IOC_MAGIC, 28, struct sk_fpga_bitstream)
+// ioctl to get hash of the running bitstream
+#define SKFPGA_IOGBITLOADED _IOR(SKFP_IOC_MAGIC, 29, struct sk_fpga_bitstream)
+// ioctl to set fpga irq coalescing, assumes the simple_debug irq registers at cs0 0x4 and 0x6
+#define SKFPGA_IOSIRQCOALESCE _IOR(SKFP_IOC_MAGIC, 30, struct sk_fpga_irq_coalesce)
+// ioctl to programm FPGA with a firmware loaded by request_firmware()
+#define SKFPGA_IOSPROGFW _IOR(SKFP_IOC_MAGIC, 31, char[PROG_FILE_NAME_LEN])
 
 // ioctl to set the current mode for the FPGA
 //#define SKFPGA_IOSMODE _IOR(SKFP_IOC_MAGIC, 3, int)
@@ -0,0 +1,1138 @@
+#ifndef SK_FPGA_USER_HEADER
+#define SK_FPGA_USER_HEADER
+
+//#include <linux-4.15/drivers/misc/fpga-sk-at91sam9m10g45-xc6slx.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <cassert>
+#include <cerrno>
+#include <ctime>
+#include <signal.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+// TODO: merge ioctl defines with ones in kernel
+#define SKFP_IOC_MAGIC 0x81
+// ioctl to write data to FPGA
+#define SKFPGA_IOSDATA _IOW(SKFP_IOC_MAGIC, 1, struct sk_fpga_data)
+// ioctl to read data from FPGA
+#define SKFPGA_IOGDATA _IOW(SKFP_IOC_MAGIC, 2, struct sk_fpga_data)
+// ioctl to set SMC timings
+#define SKFPGA_IOSSMCTIMINGS _IOW(SKFP_IOC_MAGIC, 3, struct sk_fpga_smc_timings)
+// ioctl to request SMC timings
+#define SKFPGA_IOGSMCTIMINGS _IOR(SKFP_IOC_MAGIC, 4, struct sk_fpga_smc_timings)
+// ioctl to programm FPGA with a bitstream file, the path is opened by the kernel
+#define SKFPGA_IOSPROG _IOR(SKFP_IOC_MAGIC, 5, char[256])
+// ioctl to use reset
+#define SKFPGA_IOSRESET _IOR(SKFP_IOC_MAGIC, 6, uint8_t)
+// ioctl to get reset pin level
+#define SKFPGA_IOGRESET _IOR(SKFP_IOC_MAGIC, 7, uint8_t)
+// ioctl to set arm-to-fpga pin level
+#define SKFPGA_IOSHOSTIRQ _IOR(SKFP_IOC_MAGIC, 8, uint8_t)
+// ioctl to get arm-to-fpga pin level
+#define SKFPGA_IOGHOSTIRQ _IOR(SKFP_IOC_MAGIC, 9, uint8_t)
+// TODO: implement later
+// ioctl to set fpga-to-arm as irq
+#define SKFPGA_IOSFPGAIRQ _IOR(SKFP_IOC_MAGIC, 10, uint8_t)
+// ioctl to set address space selector
+#define SKFPGA_IOSADDRSEL _IOR(SKFP_IOC_MAGIC, 12, uint8_t)
+// ioctl to get address space selector
+#define SKFPGA_IOGADDRSEL _IOR(SKFP_IOC_MAGIC, 13, uint8_t)
+// ioctl to initiate DMA transfer
+#define SKFPGA_IOSDMA _IOR(SKFP_IOC_MAGIC, 14, struct sk_fpga_dma_transaction)
+// ioctl to set pid
+#define SKFPGA_IOSPID _IOR(SKFP_IOC_MAGIC, 15, int)
+// ioctl to perform a batch of reads/writes in one call
+#define SKFPGA_IOSBATCH _IOWR(SKFP_IOC_MAGIC, 16, struct sk_fpga_batch)
+// ioctl to run a list of commands in one call
+#define SKFPGA_IOSCMDLIST _IOWR(SKFP_IOC_MAGIC, 17, struct sk_fpga_cmd_list)
+// ioctl to set what read() and poll() report for the file
+#define SKFPGA_IOSFILEMODE _IOR(SKFP_IOC_MAGIC, 18, uint8_t)
+// ioctl to queue an asynchronous DMA transfer, returns cookie
+#define SKFPGA_IOSDMASUBMIT _IOWR(SKFP_IOC_MAGIC, 19, struct sk_fpga_dma_request)
+// ioctl to reap completed asynchronous DMA transfers
+#define SKFPGA_IOGDMACOMPL _IOWR(SKFP_IOC_MAGIC, 20, struct sk_fpga_dma_reap)
+// ioctl to pin user memory for DMA, returns buffer id
+#define SKFPGA_IOSDMABUFREG _IOWR(SKFP_IOC_MAGIC, 21, struct sk_fpga_dma_buf)
+// ioctl to release user memory pinned for DMA
+#define SKFPGA_IOSDMABUFUNREG _IOR(SKFP_IOC_MAGIC, 22, uint32_t)
+// ioctl to start continuous capture into the capture ring
+#define SKFPGA_IOSCAPTURESTART _IOR(SKFP_IOC_MAGIC, 23, struct sk_fpga_capture_config)
+// ioctl to stop continuous capture
+#define SKFPGA_IOSCAPTURESTOP _IO(SKFP_IOC_MAGIC, 24)
+// ioctl to start a programming session fed by write() in FPGA_MODE_PROG
+#define SKFPGA_IOSPROGSTART _IO(SKFP_IOC_MAGIC, 25)
+// ioctl to finish the programming session, fails if fpga didn't report done
+#define SKFPGA_IOSPROGFINISH _IO(SKFP_IOC_MAGIC, 26)
+// ioctl to load a firmware into the bitstream cache, returns its hash, EBUSY during a write() session
+#define SKFPGA_IOSBITLOAD _IOWR(SKFP_IOC_MAGIC, 27, struct sk_fpga_bitstream)
+// ioctl to program a cached bitstream by hash, no-op if it's already running
+#define SKFPGA_IOSBITSWITCH _IOR(SKFP_IOC_MAGIC, 28, struct sk_fpga_bitstream)
+// ioctl to get hash of the running bitstream
+#define SKFPGA_IOGBITLOADED _IOR(SKFP_IOC_MAGIC, 29, struct sk_fpga_bitstream)
+// ioctl to set fpga irq coalescing, assumes the simple_debug irq registers at cs0 0x4 and 0x6
+#define SKFPGA_IOSIRQCOALESCE _IOR(SKFP_IOC_MAGIC, 30, struct sk_fpga_irq_coalesce)
+// ioctl to programm FPGA with a firmware from the kernel firmware search path
+#define SKFPGA_IOSPROGFW _IOR(SKFP_IOC_MAGIC, 31, char[256])
+
+enum class addr_selector
+{
+    FPGA_ADDR_UNDEFINED = 0,
+    FPGA_ADDR_CS0,
+    FPGA_ADDR_CS1,
+    FPGA_ADDR_DMA,
+    FPGA_ADDR_CAPTURE,
+    FPGA_ADDR_STATUS,  // read-only status page, mmap() only
+    FPGA_ADDR_LAST,
+};
+
+enum class file_mode
+{
+    FPGA_MODE_DATA = 0, // read() accesses fpga memory
+    FPGA_MODE_IRQ,      // read() returns number of fpga irqs since last read
+    FPGA_MODE_DMA,      // read() returns array of sk_fpga_dma_completion
+    FPGA_MODE_CAPTURE,  // read() returns captured data
+    FPGA_MODE_PROG,     // write() feeds the bitstream of the programming session
+    FPGA_MODE_LAST,
+};
+
+enum class dma_dir
+{
+    DMA_ARM_TO_FPGA,
+    DMA_FPGA_TO_ARM,
+    DMA_LAST,
+};
+
+enum class prog_state
+{
+    FPGA_PROG_STATE_NONE = 0, // not programmed since driver load
+    FPGA_PROG_STATE_BUSY,
+    FPGA_PROG_STATE_DONE,
+    FPGA_PROG_STATE_FAILED,
+};
+
+enum class fpga_op
+{
+    FPGA_OP_READ = 0,
+    FPGA_OP_WRITE,
+    FPGA_OP_LAST,
+};
+
+enum class fpga_cmd_op
+{
+    FPGA_CMD_READ = 0, // result = read(address)
+    FPGA_CMD_WRITE,    // write(address, data)
+    FPGA_CMD_RMW,      // write(address, (read(address) & ~mask) | (data & mask)), result = new value
+    FPGA_CMD_WAIT,     // poll until (read(address) & mask) == data or arg us elapsed, result = last value
+    FPGA_CMD_DELAY,    // delay for arg us
+    FPGA_CMD_HOST_IRQ, // set host irq pin to data
+    FPGA_CMD_RESET,    // set reset pin to data
+    FPGA_CMD_LAST,
+};
+
+struct sk_fpga_dma_transaction
+{
+    uint32_t addr;
+    uint32_t len;
+    uint8_t  dir;
+    uint8_t  sync;
+};
+
+struct sk_fpga_dma_request
+{
+    uint32_t addr;       // fpga phys address
+    uint32_t buf_offset; // offset inside the dma buffer
+    uint32_t len;
+    uint8_t  dir;
+    uint32_t cookie;     // filled by the driver on submit
+    uint32_t buf_id;     // 0 for the dma buffer, otherwise id of a registered user buffer
+};
+
+struct sk_fpga_dma_buf
+{
+    void*    addr;
+    uint32_t len;
+    uint32_t id;         // filled by the driver on register
+};
+
+struct sk_fpga_dma_completion
+{
+    uint32_t cookie;
+    int32_t  status;     // 0 or negative error code
+};
+
+struct sk_fpga_dma_reap
+{
+    sk_fpga_dma_completion* completions;
+    uint32_t max;        // capacity of completions
+    uint32_t min;        // block until that many completions are available
+    uint32_t num;        // filled with number of reaped completions
+};
+
+// TODO: merge data structures with ones in kernel
+struct sk_fpga_capture_config
+{
+    uint32_t addr;
+    uint32_t period_len;
+    uint32_t periods;
+};
+
+struct sk_fpga_capture_header
+{
+    uint32_t producer;
+    uint32_t consumer;
+    uint32_t period_len;
+    uint32_t periods;
+    uint32_t overruns;
+    uint32_t running;
+};
+
+// driver state readable without syscalls, see Fpga::GetStatus()
+struct sk_fpga_status
+{
+    uint32_t seq;            // odd while the page is being updated
+    uint32_t irq_count;      // fpga irq events since driver load
+    uint64_t irq_stamp_ns;   // CLOCK_MONOTONIC of the latest events
+    uint32_t dma_submitted;  // DmaTransfer() and SubmitDma() transfers
+    uint32_t dma_completed;
+    uint32_t prog_state;     // prog_state
+    uint8_t  reset;          // pin levels
+    uint8_t  host_irq;
+    uint8_t  fpga_irq;
+    uint8_t  reserved;
+};
+
+// sha256 of the bitstream without .bit header
+static constexpr size_t FPGA_BIT_HASH_LEN = 32;
+
+struct sk_fpga_bitstream
+{
+    char    name[256];
+    uint8_t hash[FPGA_BIT_HASH_LEN];
+};
+
+// fpga raises its irq once count events are pending or the oldest one waits for time_us
+struct sk_fpga_irq_coalesce
+{
+    uint16_t count;   // 0 and 1 raise irq on every event
+    uint32_t time_us; // 0 is off
+};
+
+// read() in FPGA_MODE_IRQ with room for it reports sources too
+struct sk_fpga_irq_info
+{
+    uint32_t events;
+    uint32_t sources; // FPGA_IRQ_SRC_* bits seen since the last read
+};
+
+// irq sources of simple_debug
+static constexpr uint32_t FPGA_IRQ_SRC_COUNTER = 0x1; // internal counter wrapped
+static constexpr uint32_t FPGA_IRQ_SRC_HOST = 0x2;    // host irq pin went high
+static constexpr uint32_t FPGA_IRQ_SRC_SOFT = 0x4;    // write to FPGA_REG_IRQ_RAISE
+// irq registers at the start of cs0, the driver owns all but FPGA_REG_IRQ_RAISE
+static constexpr uint32_t FPGA_REG_IRQ_STATUS = 0x0;
+static constexpr uint32_t FPGA_REG_IRQ_EVENTS = 0x2;
+static constexpr uint32_t FPGA_REG_IRQ_COUNT = 0x4;
+static constexpr uint32_t FPGA_REG_IRQ_TIME = 0x6;
+static constexpr uint32_t FPGA_REG_IRQ_RAISE = 0x8;
+
+struct sk_fpga_smc_timings
+{
+    uint32_t setup; // setup ebi timings
+    uint32_t pulse; // pulse ebi timings
+    uint32_t cycle; // cycle ebi timings
+    uint32_t mode;  // ebi mode
+    uint8_t  num;
+};
+
+struct sk_fpga_data
+{
+    uint32_t address;
+    uint16_t data;
+};
+
+struct sk_fpga_batch_entry
+{
+    uint32_t address;
+    uint16_t data;
+    uint8_t  op;
+};
+
+struct sk_fpga_batch
+{
+    sk_fpga_batch_entry* entries;
+    uint32_t num;
+};
+
+struct sk_fpga_cmd
+{
+    uint32_t address;
+    uint32_t arg;     // timeout for wait or delay in us
+    uint16_t data;
+    uint16_t mask;
+    uint8_t  op;
+};
+
+struct sk_fpga_cmd_list
+{
+    sk_fpga_cmd* cmds;
+    uint16_t* results; // one result per command, may be nullptr
+    uint32_t num;
+    int32_t  failed;   // index of the failed command or -1
+};
+
+// Transport used by Fpga, selected at compile time. The device one is a thin
+// inline wrapper over the syscalls, -DFPGA_SOFT_MODEL swaps in an in-process model.
+struct FpgaDevTransport
+{
+    int Open(const char* dev, int flags)
+    {
+        return open(dev, flags);
+    }
+
+    int Close(int fd)
+    {
+        return close(fd);
+    }
+
+    int Fcntl(int fd, int cmd, long arg = 0)
+    {
+        return fcntl(fd, cmd, arg);
+    }
+
+    int Ioctl(int fd, unsigned long req, void* arg = nullptr)
+    {
+        return ioctl(fd, req, arg);
+    }
+
+    ssize_t Read(int fd, void* buf, size_t len)
+    {
+        return read(fd, buf, len);
+    }
+
+    ssize_t Write(int fd, const void* buf, size_t len)
+    {
+        return write(fd, buf, len);
+    }
+
+    ssize_t Pread(int fd, void* buf, size_t len, off_t off)
+    {
+        return pread(fd, buf, len, off);
+    }
+
+    ssize_t Pwrite(int fd, const void* buf, size_t len, off_t off)
+    {
+        return pwrite(fd, buf, len, off);
+    }
+
+    off_t Lseek(int fd, off_t off, int whence)
+    {
+        return lseek(fd, off, whence);
+    }
+
+    ssize_t Sendfile(int outFd, int inFd, off_t* off, size_t count)
+    {
+        return sendfile(outFd, inFd, off, count);
+    }
+
+    void* Mmap(int fd, size_t len, off_t off, int prot = PROT_WRITE|PROT_READ)
+    {
+        return mmap(nullptr, len, prot, MAP_SHARED, fd, off);
+    }
+
+    int Poll(pollfd* fds, nfds_t n, int timeoutMs)
+    {
+        return poll(fds, n, timeoutMs);
+    }
+};
+
+#ifdef FPGA_SOFT_MODEL
+#include "fpga_soft.h"
+typedef FpgaSoftTransport FpgaTransport;
+#else
+typedef FpgaDevTransport FpgaTransport;
+#endif
+
+class Fpga
+{
+public:
+
+    enum class ProgState
+    {
+        FPGA_PROG_PREPARE = 0,
+        FPGA_PROG_FLUSH_BUF,
+        FPGA_PROG_FINISH,
+        FPGA_PROG_LAST,
+    };
+
+    // TODO: merge state enum with one in kernel
+    enum class FpgaState
+    {
+        FPGA_UNDEFINED = 0,    // undefined FPGA state when nothing yet happened
+        FPGA_READY_TO_PROGRAM, // set FPGA to be ready to be programmed
+        FPGA_PROGRAMMED,       // FPGA is programmed and ready to work
+        FPGA_LAST,
+    };
+
+    // TODO: get that data from kernel
+    // 25 address bits + 1 chip select equals to 64 megabytes addressable
+    static constexpr uint8_t FPGA_ADDR_BITS = 25;
+    static constexpr uint8_t FPGA_WINDOW_NUM = 2;
+    static constexpr uint32_t FPGA_WINDOW_MAX_ADDR = (1 << FPGA_ADDR_BITS);
+    static constexpr uint32_t FPGA_MAX_ADDR = FPGA_WINDOW_MAX_ADDR * FPGA_WINDOW_NUM;
+    static constexpr uint32_t DMA_BUF_SIZE  = 65536;
+    // max number of entries kernel accepts in a single batch
+    static constexpr uint32_t BATCH_MAX = 512;
+    // max number of commands kernel accepts in a single list
+    static constexpr uint32_t CMD_MAX = 256;
+    // max number of asynchronous DMA transfers queued and not reaped
+    static constexpr uint32_t DMA_RING_SIZE = 64;
+    // phys address of the fpga memory as seen by DMA
+    static constexpr uint32_t FPGA_DMA_BASE = 0x10000000;
+    static constexpr uint32_t FPGA_DMA_BASE_CS1 = 0x20000000;
+    // every address space is mmapped at its own offset
+    static constexpr uint32_t MMAP_REGION_SIZE = (64 << 20);
+    // bitstream bytes handed to the kernel per write() when programming from a file
+    static constexpr uint32_t PROG_CHUNK = 65536;
+    // ReadDma/WriteDma split the dma buffer into that many slots by default
+    static constexpr uint32_t DMA_SLOTS = 2;
+    // get a chunk inside the dma buffer, return true to abort the transfer
+    using DmaReadCb = std::function<bool(const void*, uint32_t)>;
+    using DmaWriteCb = std::function<bool(void*, uint32_t)>;
+    Fpga() = delete;
+    
+    Fpga(const char* dev)
+    {
+        m_fd = m_io.Open(dev, O_RDWR);
+        assert(IsOpened());
+        int pid = getpid();
+        m_io.Fcntl(m_fd, F_SETOWN, getpid());
+        int oflags = m_io.Fcntl(m_fd, F_GETFL);
+        m_io.Fcntl(m_fd, F_SETFL, oflags | FASYNC);
+        m_io.Ioctl(m_fd, SKFPGA_IOSPID, &pid);
+    }
+
+    // stream .bit or raw bitstream file, compressed or not, through write(), the file is read
+    // sequentially so kernel readahead overlaps with shifting bits out
+    // return true in case of error, wtf?!
+    bool ProgramFpga(const char* fw)
+    {
+        int fd = open(fw, O_RDONLY);
+        if (fd < 0)
+            return true;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        bool res = ProgramStart();
+        std::vector<uint8_t> buf(PROG_CHUNK);
+        ssize_t len = 0;
+        while (!res && ((len = read(fd, buf.data(), buf.size())) > 0))
+            res = ProgramWrite(buf.data(), len);
+        close(fd);
+        return ProgramFinish() || res || (len < 0);
+    }
+
+    // program from memory, .bit header is stripped by the kernel
+    bool ProgramFpga(const void* buf, size_t len)
+    {
+        bool res = ProgramStart();
+        if (!res)
+            res = ProgramWrite(static_cast<const uint8_t*>(buf), len);
+        return ProgramFinish() || res;
+    }
+
+    // program with a firmware loaded by the kernel from /lib/firmware
+    bool ProgramFirmware(const char* name)
+    {
+        char tmp[256] = {0};
+        strncpy(tmp, name, sizeof(tmp) - 1);
+        return (m_io.Ioctl(m_fd, SKFPGA_IOSPROGFW, &tmp) == -1);
+    }
+    
+    ~Fpga()
+    {
+        assert(IsOpened());
+        m_io.Close(m_fd);
+    }
+
+    bool IsOpened() const
+    {
+        return m_fd > 0;
+    }
+
+    bool GetTimings(sk_fpga_smc_timings* t)
+    {
+        return(m_io.Ioctl(m_fd, SKFPGA_IOGSMCTIMINGS, t) == -1);
+    }
+
+    bool SetTimings(sk_fpga_smc_timings* t)
+    {
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSSMCTIMINGS, t) == -1);
+    }
+
+    bool ReadShort(sk_fpga_data* d) const
+    {
+        assert(IsOpened());
+        assert(d->address < FPGA_MAX_ADDR);
+        return(m_io.Ioctl(m_fd, SKFPGA_IOGDATA, d) == -1);
+    }
+
+    bool WriteShort(sk_fpga_data* d)
+    {
+        assert(IsOpened());
+        assert(d->address < FPGA_MAX_ADDR);
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSDATA, d) == -1);
+    }
+
+    // executes entries in order, read results are stored in place
+    bool Batch(sk_fpga_batch_entry* e, uint32_t num) const
+    {
+        assert(IsOpened());
+        for (uint32_t done = 0; done < num; done += BATCH_MAX)
+        {
+            sk_fpga_batch b = {e + done, (num - done < BATCH_MAX) ? (num - done) : BATCH_MAX};
+            if (m_io.Ioctl(m_fd, SKFPGA_IOSBATCH, &b) == -1)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ReadBatch(sk_fpga_data* d, uint32_t num) const
+    {
+        return DoBatch(d, num, fpga_op::FPGA_OP_READ);
+    }
+
+    bool WriteBatch(sk_fpga_data* d, uint32_t num) const
+    {
+        return DoBatch(d, num, fpga_op::FPGA_OP_WRITE);
+    }
+
+    // runs commands back-to-back in the driver, failed gets index of failed command or -1
+    bool RunCommands(sk_fpga_cmd* cmds, uint16_t* results, uint32_t num, int32_t* failed = nullptr) const
+    {
+        assert(IsOpened());
+        assert(num <= CMD_MAX);
+        sk_fpga_cmd_list l = {cmds, results, num, -1};
+        bool res = (m_io.Ioctl(m_fd, SKFPGA_IOSCMDLIST, &l) == -1);
+        if (failed)
+        {
+            *failed = l.failed;
+        }
+        return res;
+    }
+
+    bool TestDMA(uint32_t addr, uint32_t len, enum dma_dir d, bool sync)
+    {
+        assert(addr < FPGA_MAX_ADDR);
+        assert(len <= DMA_BUF_SIZE);
+        assert(d == dma_dir::DMA_ARM_TO_FPGA || d == dma_dir::DMA_FPGA_TO_ARM);
+        sk_fpga_dma_transaction tran = {DmaAddr(addr), len, static_cast<uint8_t>(d), (sync) ? 1u : 0u};
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSDMA, &tran) == -1);
+    }
+
+    // pin user memory for zero-copy DMA, returns buffer id or 0 on failure
+    uint32_t RegisterDmaBuffer(void* buf, uint32_t len)
+    {
+        sk_fpga_dma_buf b = {buf, len, 0};
+        if (m_io.Ioctl(m_fd, SKFPGA_IOSDMABUFREG, &b) == -1)
+        {
+            return 0;
+        }
+        return b.id;
+    }
+
+    bool UnregisterDmaBuffer(uint32_t id)
+    {
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSDMABUFUNREG, &id) == -1);
+    }
+
+    // queue transfer between fpga addr and the buffer at bufOffset, cookie identifies its completion;
+    // bufId 0 is the mmapped dma buffer, otherwise a buffer registered by RegisterDmaBuffer
+    bool SubmitDma(uint32_t addr, uint32_t bufOffset, uint32_t len, dma_dir d, uint32_t* cookie = nullptr, uint32_t bufId = 0)
+    {
+        assert(addr < FPGA_MAX_ADDR);
+        assert(bufId || (bufOffset + len <= DMA_BUF_SIZE));
+        assert(d == dma_dir::DMA_ARM_TO_FPGA || d == dma_dir::DMA_FPGA_TO_ARM);
+        sk_fpga_dma_request req = {DmaAddr(addr), bufOffset, len, static_cast<uint8_t>(d), 0, bufId};
+        if (m_io.Ioctl(m_fd, SKFPGA_IOSDMASUBMIT, &req) == -1)
+        {
+            return true;
+        }
+        if (cookie)
+        {
+            *cookie = req.cookie;
+        }
+        return false;
+    }
+
+    // reap up to max completions waiting for at least min of them, returns number reaped or -1
+    int ReapDma(sk_fpga_dma_completion* c, uint32_t max, uint32_t min = 1)
+    {
+        sk_fpga_dma_reap r = {c, max, min, 0};
+        if (m_io.Ioctl(m_fd, SKFPGA_IOGDMACOMPL, &r) == -1)
+        {
+            return -1;
+        }
+        return r.num;
+    }
+
+    // continuously read fpga addr into a ring of periods
+    bool StartCapture(uint32_t addr, uint32_t periodLen, uint32_t periods)
+    {
+        assert(addr < FPGA_MAX_ADDR);
+        sk_fpga_capture_config c = {DmaAddr(addr), periodLen, periods};
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSCAPTURESTART, &c) == -1);
+    }
+
+    bool StopCapture()
+    {
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSCAPTURESTOP) == -1);
+    }
+
+    // keep a firmware from /lib/firmware in the kernel cache, hash identifies it later
+    bool LoadBitstream(const char* name, uint8_t* hash)
+    {
+        sk_fpga_bitstream b = {};
+        strncpy(b.name, name, sizeof(b.name) - 1);
+        if (m_io.Ioctl(m_fd, SKFPGA_IOSBITLOAD, &b) == -1)
+            return true;
+        memcpy(hash, b.hash, FPGA_BIT_HASH_LEN);
+        return false;
+    }
+
+    // program a cached bitstream, cheap if it's running already
+    bool SwitchBitstream(const uint8_t* hash)
+    {
+        sk_fpga_bitstream b = {};
+        memcpy(b.hash, hash, FPGA_BIT_HASH_LEN);
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSBITSWITCH, &b) == -1);
+    }
+
+    // fails if the running bitstream is unknown
+    bool GetLoadedBitstream(uint8_t* hash) const
+    {
+        sk_fpga_bitstream b = {};
+        if (m_io.Ioctl(m_fd, SKFPGA_IOGBITLOADED, &b) == -1)
+            return true;
+        memcpy(hash, b.hash, FPGA_BIT_HASH_LEN);
+        return false;
+    }
+
+    // map capture header and ring, ring data starts one page after the header
+    sk_fpga_capture_header* MmapCapture(uint32_t ringLen)
+    {
+        return static_cast<sk_fpga_capture_header*>(MmapRegion(addr_selector::FPGA_ADDR_CAPTURE, 0, sysconf(_SC_PAGESIZE) + ringLen));
+    }
+
+    // map read-only status page, true on error
+    bool MmapStatus()
+    {
+        m_status = static_cast<const sk_fpga_status*>(MmapRegion(addr_selector::FPGA_ADDR_STATUS, 0, sysconf(_SC_PAGESIZE), PROT_READ));
+        return !m_status;
+    }
+
+    // consistent copy of the status page with plain loads, needs MmapStatus(), true on error;
+    // changes aren't signalled, wait for irq events with IrqHandler()
+    bool GetStatus(sk_fpga_status& st) const
+    {
+        if (!m_status)
+            return true;
+        for (;;)
+        {
+            uint32_t seq = __atomic_load_n(&m_status->seq, __ATOMIC_ACQUIRE);
+            // writer holds the page for a few loads and stores only
+            if (seq & 1)
+                continue;
+            memcpy(&st, const_cast<const sk_fpga_status*>(m_status), sizeof(st));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&m_status->seq, __ATOMIC_RELAXED) == seq)
+                return false;
+        }
+    }
+
+    // write num bytes at addr of the selected window with pwrite(), true on error
+    bool Write(uint32_t addr, const void* buf, uint32_t num)
+    {
+        uint32_t done = 0;
+        while (done < num)
+        {
+            ssize_t res = m_io.Pwrite(m_fd, static_cast<const uint8_t*>(buf) + done, num - done, addr + done);
+            if (res <= 0)
+            {
+                return true;
+            }
+            done += res;
+        }
+        return false;
+    }
+
+    // read num bytes at addr of the selected window with pread(), true on error
+    bool Read(uint32_t addr, void* buf, uint32_t num)
+    {
+        uint32_t done = 0;
+        while (done < num)
+        {
+            ssize_t res = m_io.Pread(m_fd, static_cast<uint8_t*>(buf) + done, num - done, addr + done);
+            if (res <= 0)
+            {
+                return true;
+            }
+            done += res;
+        }
+        return false;
+    }
+
+    // move num bytes at addr of the selected window to outFd (socket, file) with
+    // sendfile(), data doesn't pass through this process, true on error
+    bool SendData(int outFd, uint32_t addr, uint32_t num)
+    {
+        off_t off = addr;
+        while (num)
+        {
+            ssize_t res = m_io.Sendfile(outFd, m_fd, &off, num);
+            if (res <= 0)
+            {
+                return true;
+            }
+            num -= res;
+        }
+        return false;
+    }
+
+    // single pread()/pwrite() at addr of the selected window, returns bytes done or -1
+    ssize_t ReadData(void* buf, size_t len, uint32_t addr = 0)
+    {
+        return m_io.Pread(m_fd, buf, len, addr);
+    }
+
+    ssize_t WriteData(const void* buf, size_t len, uint32_t addr = 0)
+    {
+        return m_io.Pwrite(m_fd, buf, len, addr);
+    }
+
+    void WriteMmap()
+    {
+        ;
+    }
+
+    void ReadMmap()
+    {
+        ;
+    }
+
+    // stream len bytes from fpga addr through slots of the mmapped dma buffer, cb
+    // consumes one slot while transfers into the others go on, true on error.
+    // Needs Mmap(), no other asynchronous transfers of this file may be in flight.
+    // If completions can't be reaped errno is EBUSY and the buffer stays in use,
+    // the next stream waits for those transfers before touching it
+    bool ReadDma(uint32_t addr, uint32_t len, DmaReadCb cb, uint32_t slots = DMA_SLOTS)
+    {
+        return DmaStream(addr, len, dma_dir::DMA_FPGA_TO_ARM, slots, [&](void* p, uint32_t n)
+        {
+            return cb(p, n);
+        });
+    }
+
+    // cb fills one slot while the previously filled ones are being transferred
+    bool WriteDma(uint32_t addr, uint32_t len, DmaWriteCb cb, uint32_t slots = DMA_SLOTS)
+    {
+        return DmaStream(addr, len, dma_dir::DMA_ARM_TO_FPGA, slots, cb);
+    }
+
+    bool ReadDma(uint32_t addr, void* buf, uint32_t len)
+    {
+        uint8_t* dst = static_cast<uint8_t*>(buf);
+        return ReadDma(addr, len, [&](const void* p, uint32_t n)
+        {
+            memcpy(dst, p, n);
+            dst += n;
+            return false;
+        });
+    }
+
+    bool WriteDma(uint32_t addr, const void* buf, uint32_t len)
+    {
+        const uint8_t* src = static_cast<const uint8_t*>(buf);
+        return WriteDma(addr, len, [&](void* p, uint32_t n)
+        {
+            memcpy(p, src, n);
+            src += n;
+            return false;
+        });
+    }
+
+    void GetTimings()
+    {
+        ;
+    }
+
+    void SetTimings()
+    {
+        ;
+    }
+
+    bool SetFileMode(file_mode mode)
+    {
+        assert(mode < file_mode::FPGA_MODE_LAST);
+        uint8_t val = static_cast<uint8_t>(mode);
+        if (m_io.Ioctl(m_fd, SKFPGA_IOSFILEMODE, &val) == -1)
+            return true;
+        m_mode = mode;
+        return false;
+    }
+
+    // file descriptor becomes readable on fpga irq, suitable for poll/epoll based loops
+    int GetFd() const
+    {
+        return m_fd;
+    }
+
+    // callback gets number of irq events since the last call
+    bool RegisterCallbackOnInterrupt(std::function<void(uint32_t)> cb)
+    {
+        return RegisterCallbackOnInterrupt([cb](uint32_t events, uint32_t)
+        {
+            cb(events);
+        });
+    }
+
+    // same, plus FPGA_IRQ_SRC_* bits of the sources which fired
+    bool RegisterCallbackOnInterrupt(std::function<void(uint32_t, uint32_t)> cb)
+    {
+        m_irqCallback = cb;
+        return SetFileMode(file_mode::FPGA_MODE_IRQ);
+    }
+
+    // one irq for up to count events, or for whatever came within timeUs of the first one.
+    // Only for designs with the simple_debug irq registers, kept across reprogramming
+    bool SetIrqCoalescing(uint16_t count, uint32_t timeUs = 0)
+    {
+        sk_fpga_irq_coalesce c = {count, timeUs};
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSIRQCOALESCE, &c) == -1);
+    }
+
+    bool SetAddrSpace(addr_selector sel)
+    {
+        assert((sel == addr_selector::FPGA_ADDR_CS0) || (sel == addr_selector::FPGA_ADDR_CS1) || (sel == addr_selector::FPGA_ADDR_DMA));
+        uint8_t res = static_cast<uint8_t>(sel);
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSADDRSEL, &res) == -1);
+    }
+
+    addr_selector GetAddrSpace()
+    {
+        uint8_t sel = 0;
+        if (m_io.Ioctl(m_fd, SKFPGA_IOGADDRSEL, &sel) == -1)
+        {
+            return addr_selector::FPGA_ADDR_UNDEFINED;
+        }
+        else
+        {
+            addr_selector selRes = static_cast<addr_selector>(sel);
+            assert((selRes == addr_selector::FPGA_ADDR_CS0) || (selRes == addr_selector::FPGA_ADDR_CS1));
+            return selRes;
+        }
+    }
+
+    bool SetReset(bool reset)
+    {
+        uint8_t res = reset ? 1 : 0;
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSRESET, &res) == -1);
+    }
+
+    uint8_t GetReset()
+    {
+        uint8_t reset = -1;
+        if (m_io.Ioctl(m_fd, SKFPGA_IOGRESET, &reset) == -1)
+        {
+            return -1;
+        }
+        else
+        {
+            return reset;
+        }
+    }
+
+    bool SetHostToFpgaIrq(bool val)
+    {
+        uint8_t res = val ? 1 : 0;
+        return(m_io.Ioctl(m_fd, SKFPGA_IOSHOSTIRQ, &res) == -1);
+    }
+
+    uint8_t GetHostToFpgaIrq()
+    {
+        uint8_t val = -1;
+        if (m_io.Ioctl(m_fd, SKFPGA_IOGHOSTIRQ, &val) == -1)
+        {
+            return -1;
+        }
+        else
+        {
+            return val;
+        }
+    }
+
+    uint8_t SetFpgaToHostIrq(bool set)
+    {
+        uint8_t val = set ? 1 : 0;
+        return (m_io.Ioctl(m_fd, SKFPGA_IOSFPGAIRQ, &val) == -1);
+    }
+
+    // map len bytes of the address space starting at page aligned offset, nullptr on failure
+    void* MmapRegion(addr_selector sel, uint32_t offset, uint32_t len, int prot = PROT_WRITE|PROT_READ)
+    {
+        assert(!(offset % sysconf(_SC_PAGESIZE)));
+        void* p = m_io.Mmap(m_fd, len, static_cast<uint32_t>(sel) * MMAP_REGION_SIZE + offset, prot);
+        return (p == MAP_FAILED) ? nullptr : p;
+    }
+
+    bool Mmap()
+    {
+        // use fpga mem window size
+        m_mmapCs0 = static_cast<uint16_t*>(MmapRegion(addr_selector::FPGA_ADDR_CS0, 0, FPGA_WINDOW_MAX_ADDR));
+        m_mmapCs1 = static_cast<uint16_t*>(MmapRegion(addr_selector::FPGA_ADDR_CS1, 0, FPGA_WINDOW_MAX_ADDR));
+        m_dma = MmapRegion(addr_selector::FPGA_ADDR_DMA, 0, DMA_BUF_SIZE);
+        return (!m_mmapCs0 || !m_mmapCs1 || !m_dma);
+    }
+
+    uint16_t* GetFpgaMemCs0()
+    {
+        return m_mmapCs0;
+    }
+
+    uint16_t* GetFpgaMemCs1()
+    {
+        return m_mmapCs1;
+    }
+
+    void* GetFpgaDmaBuf()
+    {
+        return m_dma;
+    }
+
+    void DmaHandler()
+    {
+        uint16_t* dmaPtr = static_cast<uint16_t*>(GetFpgaDmaBuf());
+        for (int i = 0; i < 10; i++)
+        {
+            fprintf(stderr, "Read dma buf 0x%x : 0x%x\n", (i << 1), *dmaPtr);
+            dmaPtr++;
+        }
+    }
+
+    // wait up to timeoutMs (-1 is forever) till fpga is configured, data mode only
+    bool WaitReady(int timeoutMs = -1)
+    {
+        pollfd pfd = {m_fd, POLLOUT, 0};
+        assert(m_mode == file_mode::FPGA_MODE_DATA);
+        return (m_io.Poll(&pfd, 1, timeoutMs) <= 0) || !(pfd.revents & POLLOUT);
+    }
+
+    // wait for fpga irqs up to timeoutMs (-1 is forever) and run callback,
+    // returns number of irqs handled
+    uint32_t IrqHandler(int timeoutMs = -1)
+    {
+        pollfd pfd = {m_fd, POLLIN, 0};
+        sk_fpga_irq_info info = {};
+        if (m_io.Poll(&pfd, 1, timeoutMs) <= 0)
+        {
+            return 0;
+        }
+        if (m_io.Read(m_fd, &info, sizeof(info)) != sizeof(info))
+        {
+            return 0;
+        }
+        if (m_irqCallback)
+        {
+            m_irqCallback(info.events, info.sources);
+        }
+        return info.events;
+    }
+
+private:
+    bool ProgramStart()
+    {
+        m_progPrevMode = m_mode;
+        if (m_io.Ioctl(m_fd, SKFPGA_IOSPROGSTART) == -1)
+            return true;
+        return SetFileMode(file_mode::FPGA_MODE_PROG);
+    }
+
+    bool ProgramWrite(const uint8_t* buf, size_t len)
+    {
+        while (len)
+        {
+            ssize_t res = m_io.Write(m_fd, buf, len);
+            if (res <= 0)
+                return true;
+            buf += res;
+            len -= res;
+        }
+        return false;
+    }
+
+    // always called after ProgramStart to release the session
+    bool ProgramFinish()
+    {
+        bool res = (m_io.Ioctl(m_fd, SKFPGA_IOSPROGFINISH) == -1);
+        return SetFileMode(m_progPrevMode) || res;
+    }
+
+    // chunk i of the transfer goes through slot i % slots, so slots complete in order
+    // and the oldest one is always the next to reap
+    bool DmaStream(uint32_t addr, uint32_t len, dma_dir d, uint32_t slots, DmaWriteCb cb)
+    {
+        assert(m_dma);
+        assert(slots && (slots <= DMA_RING_SIZE) && (slots <= DMA_BUF_SIZE / 2));
+        assert(!(addr & 0x1) && !(len & 0x1) && (addr <= FPGA_MAX_ADDR) && (len <= FPGA_MAX_ADDR - addr));
+        uint8_t* base = static_cast<uint8_t*>(m_dma);
+        uint32_t slotLen = (DMA_BUF_SIZE / slots) & ~0x1u;
+        std::vector<uint32_t> cookies(slots);
+        std::vector<uint32_t> lens(slots);
+        uint32_t head = 0;
+        uint32_t busy = 0;
+        uint32_t submitted = 0;
+        bool failed = false;
+
+        // slots of a stream which failed to reap may still be written by the engine
+        if (DrainDma())
+        {
+            errno = EBUSY;
+            return true;
+        }
+
+        // wait for the oldest slot, reads hand it over to cb
+        auto reap = [&]()
+        {
+            sk_fpga_dma_completion c = {};
+            uint32_t slot = head;
+            int n = 0;
+            do
+            {
+                n = ReapDma(&c, 1);
+            } while ((n == -1) && (errno == EINTR));
+            if (n != 1)
+            {
+                // transfers are still in flight, the next stream reaps them first
+                m_dmaOrphans += busy;
+                busy = 0;
+                errno = EBUSY;
+                return true;
+            }
+            head = (head + 1) % slots;
+            busy--;
+            if (c.status || (c.cookie != cookies[slot]))
+            {
+                return true;
+            }
+            return (d == dma_dir::DMA_FPGA_TO_ARM) && !failed && cb(base + slot * slotLen, lens[slot]);
+        };
+
+        while (!failed && (submitted < len))
+        {
+            if ((busy == slots) && reap())
+            {
+                failed = true;
+                break;
+            }
+            uint32_t a = addr + submitted;
+            uint32_t slot = (head + busy) % slots;
+            // a chunk can't cross from cs0 to cs1, they are apart on the bus
+            uint32_t n = std::min(std::min(slotLen, len - submitted), FPGA_WINDOW_MAX_ADDR - a % FPGA_WINDOW_MAX_ADDR);
+            if ((d == dma_dir::DMA_ARM_TO_FPGA) && cb(base + slot * slotLen, n))
+            {
+                failed = true;
+                break;
+            }
+            if (SubmitDma(a, slot * slotLen, n, d, &cookies[slot]))
+            {
+                failed = true;
+                break;
+            }
+            lens[slot] = n;
+            busy++;
+            submitted += n;
+        }
+        while (busy)
+        {
+            failed |= reap();
+        }
+        return failed;
+    }
+
+    // reap completions of transfers left in flight by a failed DmaStream(), true on error
+    bool DrainDma()
+    {
+        while (m_dmaOrphans)
+        {
+            sk_fpga_dma_completion c = {};
+            if (ReapDma(&c, 1) == 1)
+            {
+                m_dmaOrphans--;
+            }
+            else if (errno != EINTR)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // addresses above the first window belong to cs1
+    static uint32_t DmaAddr(uint32_t addr)
+    {
+        return (addr < FPGA_WINDOW_MAX_ADDR) ? (FPGA_DMA_BASE + addr) : (FPGA_DMA_BASE_CS1 + addr - FPGA_WINDOW_MAX_ADDR);
+    }
+
+    bool DoBatch(sk_fpga_data* d, uint32_t num, fpga_op op) const
+    {
+        sk_fpga_batch_entry chunk[BATCH_MAX];
+        for (uint32_t done = 0; done < num; done += BATCH_MAX)
+        {
+            uint32_t n = (num - done < BATCH_MAX) ? (num - done) : BATCH_MAX;
+            for (uint32_t i = 0; i < n; i++)
+            {
+                assert(d[done + i].address < FPGA_MAX_ADDR);
+                chunk[i] = {d[done + i].address, d[done + i].data, static_cast<uint8_t>(op)};
+            }
+            if (Batch(chunk, n))
+            {
+                return true;
+            }
+            if (op == fpga_op::FPGA_OP_READ)
+            {
+                for (uint32_t i = 0; i < n; i++)
+                {
+                    d[done + i].data = chunk[i].data;
+                }
+            }
+        }
+        return false;
+    }
+
+    mutable FpgaTransport m_io;
+    int m_fd = -EFAULT;
+    file_mode m_mode = file_mode::FPGA_MODE_DATA;
+    file_mode m_progPrevMode = file_mode::FPGA_MODE_DATA; // restored after programming
+    uint16_t* m_mmapCs0 = nullptr;
+    uint16_t* m_mmapCs1 = nullptr;
+    void*     m_dma     = nullptr;
+    uint32_t  m_dmaOrphans = 0; // DmaStream() transfers nobody has reaped yet
+    const sk_fpga_status* m_status = nullptr;
+    std::function<void(uint32_t, uint32_t)> m_irqCallback;
+};
+
+#endif
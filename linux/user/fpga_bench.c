@@ -0,0 +1,495 @@
+#include "fpga.h"
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Measures throughput and per-op latency of every host<->fpga data path.
+// One op moves `size` bytes through the path, results go to stdout as CSV or JSON.
+
+struct BenchResult
+{
+    const char* path;
+    const char* dir;
+    uint32_t cs;
+    uint32_t size;
+    bool failed;
+    uint64_t totalNs;
+    std::vector<uint64_t> lat; // per op latency, ns
+};
+
+struct BenchConfig
+{
+    const char* dev = "/dev/fpga";
+    std::string paths = "ioctl,batch,rw,sendfile,mmap16,mmap32,dma_sync,dma_async,dma_stream";
+    std::vector<uint32_t> sizes = {2, 64, 512, 4096, 65536};
+    std::vector<uint32_t> cs = {0, 1};
+    uint32_t iters = 1000;
+    uint32_t base = 0;       // fpga address inside the window
+    uint32_t depth = 8;      // in-flight transfers for async DMA
+    bool json = false;
+};
+
+static inline uint64_t NowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool PathEnabled(const BenchConfig& cfg, const char* path)
+{
+    std::string list = "," + cfg.paths + ",";
+    return list.find(std::string(",") + path + ",") != std::string::npos;
+}
+
+// run op iters times after a short warm up, op returns true on error
+template <typename Op>
+static BenchResult Run(const char* path, const char* dir, uint32_t cs, uint32_t size, uint32_t iters, Op op)
+{
+    BenchResult r = {path, dir, cs, size, false, 0, {}};
+    for (uint32_t i = 0; i < iters / 10; i++)
+    {
+        if (op(i))
+        {
+            r.failed = true;
+            return r;
+        }
+    }
+    r.lat.reserve(iters);
+    uint64_t begin = NowNs();
+    for (uint32_t i = 0; i < iters; i++)
+    {
+        uint64_t start = NowNs();
+        if (op(i))
+        {
+            r.failed = true;
+            break;
+        }
+        r.lat.push_back(NowNs() - start);
+    }
+    r.totalNs = NowNs() - begin;
+    return r;
+}
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, uint32_t permille)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t idx = std::min(sorted.size() - 1, sorted.size() * permille / 1000);
+    return sorted[idx];
+}
+
+static void PrintCsvHeader()
+{
+    printf("path,dir,cs,size,ops,failed,seconds,mb_s,ops_s,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+}
+
+static void PrintResult(const BenchConfig& cfg, BenchResult& r, bool first)
+{
+    std::sort(r.lat.begin(), r.lat.end());
+    double secs = r.totalNs / 1e9;
+    double ops = r.lat.size();
+    double mbs = (secs > 0) ? (ops * r.size / (1024.0 * 1024.0) / secs) : 0;
+    double opss = (secs > 0) ? (ops / secs) : 0;
+    uint64_t minNs = r.lat.empty() ? 0 : r.lat.front();
+    uint64_t maxNs = r.lat.empty() ? 0 : r.lat.back();
+
+    if (!cfg.json)
+    {
+        printf("%s,%s,%u,%u,%zu,%d,%f,%f,%f,%llu,%llu,%llu,%llu,%llu,%llu\n",
+               r.path, r.dir, r.cs, r.size, r.lat.size(), r.failed ? 1 : 0, secs, mbs, opss,
+               (unsigned long long)minNs,
+               (unsigned long long)Percentile(r.lat, 500),
+               (unsigned long long)Percentile(r.lat, 900),
+               (unsigned long long)Percentile(r.lat, 990),
+               (unsigned long long)Percentile(r.lat, 999),
+               (unsigned long long)maxNs);
+        return;
+    }
+
+    // log2 histogram, bucket k holds latencies in [2^k, 2^(k+1)) ns
+    uint32_t hist[64] = {0};
+    for (uint64_t l : r.lat)
+    {
+        uint32_t k = 0;
+        while ((k < 63) && (l >> (k + 1)))
+        {
+            k++;
+        }
+        hist[k]++;
+    }
+    printf("%s  {\"path\": \"%s\", \"dir\": \"%s\", \"cs\": %u, \"size\": %u, \"ops\": %zu, \"failed\": %s, "
+           "\"seconds\": %f, \"mb_s\": %f, \"ops_s\": %f, \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+           "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, \"hist\": [",
+           first ? "" : ",\n", r.path, r.dir, r.cs, r.size, r.lat.size(), r.failed ? "true" : "false",
+           secs, mbs, opss,
+           (unsigned long long)minNs,
+           (unsigned long long)Percentile(r.lat, 500),
+           (unsigned long long)Percentile(r.lat, 900),
+           (unsigned long long)Percentile(r.lat, 990),
+           (unsigned long long)Percentile(r.lat, 999),
+           (unsigned long long)maxNs);
+    bool firstBucket = true;
+    for (uint32_t k = 0; k < 64; k++)
+    {
+        if (hist[k])
+        {
+            printf("%s[%llu, %u]", firstBucket ? "" : ", ", 1ull << k, hist[k]);
+            firstBucket = false;
+        }
+    }
+    printf("]}");
+}
+
+static std::vector<uint32_t> ParseList(const char* s)
+{
+    std::vector<uint32_t> res;
+    std::string str(s);
+    size_t pos = 0;
+    while (pos < str.size())
+    {
+        size_t next = str.find(',', pos);
+        if (next == std::string::npos)
+        {
+            next = str.size();
+        }
+        res.push_back(strtoul(str.substr(pos, next - pos).c_str(), nullptr, 0));
+        pos = next + 1;
+    }
+    return res;
+}
+
+static void Usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-d dev] [-p paths] [-s sizes] [-c cs] [-n iters] [-a addr] [-q depth] [-j]\n"
+                    "  -p  comma separated: ioctl,batch,rw,sendfile,mmap16,mmap32,dma_sync,dma_async,dma_stream\n"
+                    "  -s  comma separated op sizes in bytes\n"
+                    "  -c  comma separated chip selects, 0 and/or 1\n"
+                    "  -j  JSON output instead of CSV\n", name);
+}
+
+int main (int argc, char* argv[])
+{
+    BenchConfig cfg;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "d:p:s:c:n:a:q:jh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': cfg.dev = optarg; break;
+        case 'p': cfg.paths = optarg; break;
+        case 's': cfg.sizes = ParseList(optarg); break;
+        case 'c': cfg.cs = ParseList(optarg); break;
+        case 'n': cfg.iters = strtoul(optarg, nullptr, 0); break;
+        case 'a': cfg.base = strtoul(optarg, nullptr, 0); break;
+        case 'q': cfg.depth = strtoul(optarg, nullptr, 0); break;
+        case 'j': cfg.json = true; break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!cfg.iters || !cfg.depth || (cfg.base & 0x1))
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    Fpga f(cfg.dev);
+    if (f.Mmap())
+    {
+        fprintf(stderr, "Failed to mmap fpga memory\n");
+        return 1;
+    }
+
+    uint32_t maxSize = 0;
+    for (uint32_t size : cfg.sizes)
+    {
+        maxSize = std::max(maxSize, size);
+    }
+    std::vector<uint16_t> buf(maxSize / sizeof(uint16_t) + 1);
+    std::vector<sk_fpga_data> data;
+    bool first = true;
+    auto report = [&](BenchResult r)
+    {
+        PrintResult(cfg, r, first);
+        first = false;
+    };
+
+    if (cfg.json)
+    {
+        printf("[\n");
+    }
+    else
+    {
+        PrintCsvHeader();
+    }
+
+    for (uint32_t cs : cfg.cs)
+    {
+        if (cs > 1)
+        {
+            continue;
+        }
+        addr_selector sel = cs ? addr_selector::FPGA_ADDR_CS1 : addr_selector::FPGA_ADDR_CS0;
+        f.SetAddrSpace(sel);
+        volatile uint16_t* mem16 = (cs ? f.GetFpgaMemCs1() : f.GetFpgaMemCs0()) + cfg.base / sizeof(uint16_t);
+        volatile uint32_t* mem32 = reinterpret_cast<volatile uint32_t*>(mem16);
+        uint32_t dmaAddr = cs * Fpga::FPGA_WINDOW_MAX_ADDR + cfg.base;
+
+        for (uint32_t size : cfg.sizes)
+        {
+            if (!size || (size & 0x1) || (cfg.base + size > Fpga::FPGA_WINDOW_MAX_ADDR))
+            {
+                continue;
+            }
+            uint32_t shorts = size / sizeof(uint16_t);
+            data.resize(shorts);
+            for (uint32_t i = 0; i < shorts; i++)
+            {
+                data[i] = {cfg.base + i * 2u, static_cast<uint16_t>(i)};
+            }
+
+            // single short per syscall, worth it only for small ops
+            if (PathEnabled(cfg, "ioctl") && (size <= 4096))
+            {
+                report(Run("ioctl", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < shorts; i++)
+                    {
+                        if (f.ReadShort(&data[i]))
+                        {
+                            return true;
+                        }
+                    }
+                    return false;
+                }));
+                report(Run("ioctl", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < shorts; i++)
+                    {
+                        if (f.WriteShort(&data[i]))
+                        {
+                            return true;
+                        }
+                    }
+                    return false;
+                }));
+            }
+
+            if (PathEnabled(cfg, "batch"))
+            {
+                report(Run("batch", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.ReadBatch(data.data(), shorts);
+                }));
+                report(Run("batch", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.WriteBatch(data.data(), shorts);
+                }));
+            }
+
+            // pread()/pwrite() from the beginning of the window
+            if (PathEnabled(cfg, "rw"))
+            {
+                report(Run("rw", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    uint32_t done = 0;
+                    while (done < size)
+                    {
+                        ssize_t res = f.ReadData(reinterpret_cast<uint8_t*>(buf.data()) + done, size - done, cfg.base + done);
+                        if (res <= 0)
+                        {
+                            return true;
+                        }
+                        done += res;
+                    }
+                    return false;
+                }));
+                report(Run("rw", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    uint32_t done = 0;
+                    while (done < size)
+                    {
+                        ssize_t res = f.WriteData(reinterpret_cast<uint8_t*>(buf.data()) + done, size - done, cfg.base + done);
+                        if (res <= 0)
+                        {
+                            return true;
+                        }
+                        done += res;
+                    }
+                    return false;
+                }));
+            }
+
+            // window to a local socket without passing through the process, reader drains the other end
+            if (PathEnabled(cfg, "sendfile"))
+            {
+                int sock[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock))
+                {
+                    fprintf(stderr, "Failed to create socket pair\n");
+                    return 1;
+                }
+                std::thread drain([&]()
+                {
+                    char sink[65536];
+                    while (read(sock[1], sink, sizeof(sink)) > 0)
+                    {
+                        ;
+                    }
+                });
+                report(Run("sendfile", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.SendData(sock[0], cfg.base, size);
+                }));
+                close(sock[0]);
+                drain.join();
+                close(sock[1]);
+            }
+
+            if (PathEnabled(cfg, "mmap16"))
+            {
+                report(Run("mmap16", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < shorts; i++)
+                    {
+                        buf[i] = mem16[i];
+                    }
+                    return false;
+                }));
+                report(Run("mmap16", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < shorts; i++)
+                    {
+                        mem16[i] = buf[i];
+                    }
+                    return false;
+                }));
+            }
+
+            // ebi splits every word into two bus cycles, measures the cpu side win only
+            if (PathEnabled(cfg, "mmap32") && !(size & 0x3) && !(cfg.base & 0x3))
+            {
+                uint32_t words = size / sizeof(uint32_t);
+                uint32_t* buf32 = reinterpret_cast<uint32_t*>(buf.data());
+                report(Run("mmap32", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < words; i++)
+                    {
+                        buf32[i] = mem32[i];
+                    }
+                    return false;
+                }));
+                report(Run("mmap32", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    for (uint32_t i = 0; i < words; i++)
+                    {
+                        mem32[i] = buf32[i];
+                    }
+                    return false;
+                }));
+            }
+
+            if (PathEnabled(cfg, "dma_sync") && (size <= Fpga::DMA_BUF_SIZE))
+            {
+                report(Run("dma_sync", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.TestDMA(dmaAddr, size, dma_dir::DMA_FPGA_TO_ARM, true);
+                }));
+                report(Run("dma_sync", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.TestDMA(dmaAddr, size, dma_dir::DMA_ARM_TO_FPGA, true);
+                }));
+            }
+
+            // keeps up to depth transfers queued, op latency is submit to reap of the same transfer
+            if (PathEnabled(cfg, "dma_async") && (size <= Fpga::DMA_BUF_SIZE))
+            {
+                uint32_t depth = std::min(cfg.depth, Fpga::DMA_RING_SIZE);
+                uint32_t slots = std::max(1u, std::min(depth, Fpga::DMA_BUF_SIZE / size));
+                const dma_dir dirs[] = {dma_dir::DMA_FPGA_TO_ARM, dma_dir::DMA_ARM_TO_FPGA};
+                for (dma_dir d : dirs)
+                {
+                    BenchResult r = {"dma_async", (d == dma_dir::DMA_FPGA_TO_ARM) ? "rd" : "wr", cs, size, false, 0, {}};
+                    std::vector<uint64_t> started(cfg.iters);
+                    sk_fpga_dma_completion done[Fpga::DMA_RING_SIZE];
+                    uint32_t submitted = 0;
+                    uint32_t reaped = 0;
+                    r.lat.reserve(cfg.iters);
+                    uint64_t begin = NowNs();
+                    while ((reaped < cfg.iters) && !r.failed)
+                    {
+                        while ((submitted < cfg.iters) && (submitted - reaped < depth))
+                        {
+                            started[submitted] = NowNs();
+                            if (f.SubmitDma(dmaAddr, (submitted % slots) * size, size, d, nullptr))
+                            {
+                                r.failed = true;
+                                break;
+                            }
+                            submitted++;
+                        }
+                        int n = f.ReapDma(done, Fpga::DMA_RING_SIZE, 1);
+                        if (n <= 0)
+                        {
+                            r.failed = true;
+                            break;
+                        }
+                        uint64_t now = NowNs();
+                        for (int i = 0; i < n; i++)
+                        {
+                            // completions come in order of submission on a single channel
+                            r.failed |= (done[i].status != 0);
+                            r.lat.push_back(now - started[reaped]);
+                            reaped++;
+                        }
+                    }
+                    r.totalNs = NowNs() - begin;
+                    if (submitted != reaped)
+                    {
+                        // drain what is still in flight
+                        f.ReapDma(done, Fpga::DMA_RING_SIZE, submitted - reaped);
+                    }
+                    report(r);
+                }
+            }
+
+            // any size, slots of the dma buffer are copied while the next transfer runs
+            if (PathEnabled(cfg, "dma_stream"))
+            {
+                uint32_t slots = std::max(2u, std::min(cfg.depth, Fpga::DMA_RING_SIZE + 0));
+                report(Run("dma_stream", "rd", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.ReadDma(dmaAddr, size, [&](const void* p, uint32_t n)
+                    {
+                        memcpy(buf.data(), p, n);
+                        return false;
+                    }, slots);
+                }));
+                report(Run("dma_stream", "wr", cs, size, cfg.iters, [&](uint32_t)
+                {
+                    return f.WriteDma(dmaAddr, size, [&](void* p, uint32_t n)
+                    {
+                        memcpy(p, buf.data(), n);
+                        return false;
+                    }, slots);
+                }));
+            }
+        }
+    }
+
+    if (cfg.json)
+    {
+        printf("\n]\n");
+    }
+    return 0;
+}
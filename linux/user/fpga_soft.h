@@ -0,0 +1,947 @@
+#ifndef SK_FPGA_SOFT_HEADER
+#define SK_FPGA_SOFT_HEADER
+
+// In-process model of /dev/fpga with simple_debug loaded, used by Fpga when
+// built with -DFPGA_SOFT_MODEL. Mirrors the driver ABI closely enough for the
+// user programs and the benchmark to run without the board:
+//  - reads of cs0/cs1 return (address | cs), except the RAM
+//  - 32 cells of RAM at 0x2000 on cs0
+//  - irq status, events and coalescing registers at cs0 0x0..0x8
+//  - irq events come from a free running counter every FPGA_SOFT_IRQ_PERIOD_MS
+//    (2^32 fpga clocks on the board), from the host irq pin going high and
+//    from writes to FPGA_REG_IRQ_RAISE, while reset is released
+// Pending events are acked right away once the coalescing condition is met,
+// the way the driver's irq thread does.
+// DMA completes synchronously. Bitstreams are accepted and dropped, cached
+// ones are identified by their name. Capture is not modelled. Each Fpga
+// object owns its own model, and the fd it gets can't be polled by other code.
+// Stores through an mmapped window land in plain memory. Outside the RAM
+// they overwrite the echo pattern, which the board never does.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FpgaSoftTransport
+{
+public:
+    static constexpr int SOFT_FD = 1000;
+    static constexpr uint32_t WINDOW_SIZE = (1 << 25);
+    static constexpr uint32_t CS0_PHYS = 0x10000000;
+    static constexpr uint32_t CS1_PHYS = 0x20000000;
+    static constexpr uint32_t RAM_START = 0x2000;
+    static constexpr uint32_t RAM_SIZE = 32;
+    static constexpr uint32_t DMA_BUF_SIZE = 65536;
+    static constexpr uint32_t MMAP_REGION_SIZE = (64 << 20);
+    static constexpr uint32_t BATCH_MAX = 512;
+    static constexpr uint32_t CMD_MAX = 256;
+    static constexpr uint32_t CMD_MAX_TIMEOUT_US = 1000000;
+    static constexpr uint32_t DMA_RING_SIZE = 64;
+    static constexpr uint32_t DMA_USER_BUFS = 16;
+    static constexpr uint32_t FPGA_FREQ = 133333333; // fpga-frequency of the dts
+    static constexpr uint32_t IRQ_SOURCES = 16;
+    static constexpr uint32_t IRQ_TIME_SHIFT = 8;
+
+    FpgaSoftTransport()
+    {
+        const char* period = getenv("FPGA_SOFT_IRQ_PERIOD_MS");
+        m_irqPeriod = std::chrono::milliseconds(period ? strtoul(period, nullptr, 0) : 1000);
+        m_dmaBuf.resize(DMA_BUF_SIZE / sizeof(uint16_t));
+    }
+
+    int Open(const char*, int)
+    {
+        return SOFT_FD;
+    }
+
+    int Close(int)
+    {
+        return 0;
+    }
+
+    int Fcntl(int, int, long = 0)
+    {
+        return 0;
+    }
+
+    int Ioctl(int, unsigned long req, void* arg = nullptr)
+    {
+        Tick();
+        switch (req)
+        {
+        case SKFPGA_IOSSMCTIMINGS:
+        {
+            sk_fpga_smc_timings* t = static_cast<sk_fpga_smc_timings*>(arg);
+            if (t->num >= 8)
+            {
+                return Fail(EFAULT);
+            }
+            // copied as is, padding included, the way the driver does
+            memcpy(&m_smc[t->num], t, sizeof(*t));
+            m_smcNum = t->num;
+            return 0;
+        }
+        case SKFPGA_IOGSMCTIMINGS:
+            // driver reports the chip select set up last
+            memcpy(arg, &m_smc[m_smcNum], sizeof(sk_fpga_smc_timings));
+            return 0;
+        case SKFPGA_IOSDATA:
+        case SKFPGA_IOGDATA:
+        {
+            sk_fpga_data* d = static_cast<sk_fpga_data*>(arg);
+            if (!DataSel() || !ValidAddr(d->address))
+            {
+                return Fail(EINVAL);
+            }
+            if (req == SKFPGA_IOSDATA)
+            {
+                BusWrite(m_sel, d->address, d->data);
+            }
+            else
+            {
+                d->data = BusRead(m_sel, d->address);
+            }
+            return 0;
+        }
+        case SKFPGA_IOSPROG:
+        case SKFPGA_IOSPROGFW:
+            return 0;
+        case SKFPGA_IOSPROGSTART:
+            if (m_progSession)
+            {
+                return Fail(EBUSY);
+            }
+            m_progSession = true;
+            m_bitLoaded = false;
+            return 0;
+        case SKFPGA_IOSPROGFINISH:
+            if (!m_progSession)
+            {
+                return Fail(EPERM);
+            }
+            m_progSession = false;
+            return 0;
+        case SKFPGA_IOSBITLOAD:
+        {
+            // firmware isn't read, hash is made of the name. The driver hashes
+            // the file contents instead: a name may get a new hash once the file
+            // changes and different names may share one, don't rely on either here
+            sk_fpga_bitstream* b = static_cast<sk_fpga_bitstream*>(arg);
+            size_t h = std::hash<std::string>()(std::string(b->name, strnlen(b->name, sizeof(b->name))));
+            for (size_t i = 0; i < FPGA_BIT_HASH_LEN; i++)
+            {
+                b->hash[i] = static_cast<uint8_t>(h >> ((i % sizeof(h)) * 8));
+            }
+            std::string key(reinterpret_cast<char*>(b->hash), FPGA_BIT_HASH_LEN);
+            if (std::find(m_bitCache.begin(), m_bitCache.end(), key) == m_bitCache.end())
+            {
+                m_bitCache.push_back(key);
+            }
+            return 0;
+        }
+        case SKFPGA_IOSBITSWITCH:
+        {
+            sk_fpga_bitstream* b = static_cast<sk_fpga_bitstream*>(arg);
+            std::string key(reinterpret_cast<char*>(b->hash), FPGA_BIT_HASH_LEN);
+            if (std::find(m_bitCache.begin(), m_bitCache.end(), key) == m_bitCache.end())
+            {
+                return Fail(ENOENT);
+            }
+            m_bitLoaded = true;
+            memcpy(m_bitHash, b->hash, FPGA_BIT_HASH_LEN);
+            return 0;
+        }
+        case SKFPGA_IOGBITLOADED:
+            if (!m_bitLoaded)
+            {
+                return Fail(ENODATA);
+            }
+            memcpy(static_cast<sk_fpga_bitstream*>(arg)->hash, m_bitHash, FPGA_BIT_HASH_LEN);
+            return 0;
+        case SKFPGA_IOSRESET:
+            SetReset(*static_cast<uint8_t*>(arg) != 0);
+            return 0;
+        case SKFPGA_IOGRESET:
+            *static_cast<uint8_t*>(arg) = m_running ? 1 : 0;
+            return 0;
+        case SKFPGA_IOSHOSTIRQ:
+            SetHostIrq(*static_cast<uint8_t*>(arg) != 0);
+            return 0;
+        case SKFPGA_IOGHOSTIRQ:
+            *static_cast<uint8_t*>(arg) = m_hostIrq ? 1 : 0;
+            return 0;
+        case SKFPGA_IOSFPGAIRQ:
+            m_irqEnabled = (*static_cast<uint8_t*>(arg) != 0);
+            return 0;
+        case SKFPGA_IOSIRQCOALESCE:
+        {
+            sk_fpga_irq_coalesce* c = static_cast<sk_fpga_irq_coalesce*>(arg);
+            uint64_t ticks = (static_cast<uint64_t>(c->time_us) * FPGA_FREQ / 1000000) >> IRQ_TIME_SHIFT;
+            m_irqCoalCount = c->count;
+            m_irqCoalTime = c->time_us ? std::min<uint64_t>(std::max<uint64_t>(ticks, 1), 0xFFFF) : 0;
+            return 0;
+        }
+        case SKFPGA_IOSADDRSEL:
+        {
+            uint8_t sel = *static_cast<uint8_t*>(arg);
+            if ((sel == static_cast<uint8_t>(addr_selector::FPGA_ADDR_UNDEFINED)) ||
+                (sel >= static_cast<uint8_t>(addr_selector::FPGA_ADDR_LAST)))
+            {
+                return Fail(EINVAL);
+            }
+            m_sel = static_cast<addr_selector>(sel);
+            return 0;
+        }
+        case SKFPGA_IOGADDRSEL:
+            *static_cast<uint8_t*>(arg) = static_cast<uint8_t>(m_sel);
+            return 0;
+        case SKFPGA_IOSDMA:
+        {
+            sk_fpga_dma_transaction* t = static_cast<sk_fpga_dma_transaction*>(arg);
+            if ((t->len > DMA_BUF_SIZE) ||
+                DmaCopy(t->addr, reinterpret_cast<uint8_t*>(m_dmaBuf.data()), t->len, static_cast<dma_dir>(t->dir)))
+            {
+                return Fail(EIO);
+            }
+            return 0;
+        }
+        case SKFPGA_IOSPID:
+            return 0;
+        case SKFPGA_IOSBATCH:
+            return DoBatch(static_cast<sk_fpga_batch*>(arg));
+        case SKFPGA_IOSCMDLIST:
+            return DoCmdList(static_cast<sk_fpga_cmd_list*>(arg));
+        case SKFPGA_IOSFILEMODE:
+        {
+            uint8_t mode = *static_cast<uint8_t*>(arg);
+            if (mode >= static_cast<uint8_t>(file_mode::FPGA_MODE_LAST))
+            {
+                return Fail(EINVAL);
+            }
+            m_mode = static_cast<file_mode>(mode);
+            return 0;
+        }
+        case SKFPGA_IOSDMASUBMIT:
+            return DmaSubmit(static_cast<sk_fpga_dma_request*>(arg));
+        case SKFPGA_IOGDMACOMPL:
+        {
+            sk_fpga_dma_reap* r = static_cast<sk_fpga_dma_reap*>(arg);
+            // every transfer is complete already, nothing more can come
+            if (!r->max || (m_completions.size() < r->min))
+            {
+                return Fail(r->max ? EAGAIN : EINVAL);
+            }
+            r->num = ReapCompletions(r->completions, r->max);
+            return 0;
+        }
+        case SKFPGA_IOSDMABUFREG:
+        {
+            sk_fpga_dma_buf* b = static_cast<sk_fpga_dma_buf*>(arg);
+            for (uint32_t i = 0; i < DMA_USER_BUFS; i++)
+            {
+                if (!m_userBufs[i].addr)
+                {
+                    m_userBufs[i] = *b;
+                    b->id = m_userBufs[i].id = i + 1;
+                    return 0;
+                }
+            }
+            return Fail(ENOSPC);
+        }
+        case SKFPGA_IOSDMABUFUNREG:
+        {
+            uint32_t id = *static_cast<uint32_t*>(arg);
+            if (!id || (id > DMA_USER_BUFS) || !m_userBufs[id - 1].addr)
+            {
+                return Fail(EINVAL);
+            }
+            m_userBufs[id - 1] = sk_fpga_dma_buf();
+            return 0;
+        }
+        default:
+            return Fail(ENOTTY);
+        }
+    }
+
+    ssize_t Read(int, void* buf, size_t len)
+    {
+        Tick();
+        switch (m_mode)
+        {
+        case file_mode::FPGA_MODE_IRQ:
+        {
+            if (len < sizeof(uint32_t))
+            {
+                return Fail(EINVAL);
+            }
+            while (m_irqCount == m_irqSeen)
+            {
+                if (!WaitTick(-1))
+                {
+                    return Fail(EAGAIN);
+                }
+            }
+            sk_fpga_irq_info info = {m_irqCount - m_irqSeen, 0};
+            m_irqSeen = m_irqCount;
+            if (len < sizeof(info))
+            {
+                memcpy(buf, &info.events, sizeof(info.events));
+                return sizeof(info.events);
+            }
+            for (uint32_t i = 0; i < IRQ_SOURCES; i++)
+            {
+                if (m_irqSrcCount[i] != m_irqSrcSeen[i])
+                {
+                    info.sources |= (1u << i);
+                }
+                m_irqSrcSeen[i] = m_irqSrcCount[i];
+            }
+            memcpy(buf, &info, sizeof(info));
+            return sizeof(info);
+        }
+        case file_mode::FPGA_MODE_DMA:
+        {
+            uint32_t max = len / sizeof(sk_fpga_dma_completion);
+            if (!max)
+            {
+                return Fail(EINVAL);
+            }
+            if (m_completions.empty())
+            {
+                return Fail(EAGAIN);
+            }
+            return ReapCompletions(static_cast<sk_fpga_dma_completion*>(buf), max) * sizeof(sk_fpga_dma_completion);
+        }
+        case file_mode::FPGA_MODE_DATA:
+        {
+            ssize_t res = DataRead(buf, len, m_pos);
+            if (res > 0)
+            {
+                m_pos += res;
+            }
+            return res;
+        }
+        default:
+            return Fail(ENODATA);
+        }
+    }
+
+    ssize_t Write(int, const void* buf, size_t len)
+    {
+        Tick();
+        if (m_mode == file_mode::FPGA_MODE_PROG)
+        {
+            // bitstream is dropped, simple_debug is always loaded
+            return m_progSession ? len : Fail(EPERM);
+        }
+        if (m_mode != file_mode::FPGA_MODE_DATA)
+        {
+            return Fail(EINVAL);
+        }
+        ssize_t res = DataWrite(buf, len, m_pos);
+        if (res > 0)
+        {
+            m_pos += res;
+        }
+        return res;
+    }
+
+    // position only matters for data accesses, like in the driver
+    ssize_t Pread(int fd, void* buf, size_t len, off_t off)
+    {
+        if (m_mode != file_mode::FPGA_MODE_DATA)
+        {
+            return Read(fd, buf, len);
+        }
+        Tick();
+        return DataRead(buf, len, off);
+    }
+
+    ssize_t Pwrite(int fd, const void* buf, size_t len, off_t off)
+    {
+        if (m_mode != file_mode::FPGA_MODE_DATA)
+        {
+            return Write(fd, buf, len);
+        }
+        Tick();
+        return DataWrite(buf, len, off);
+    }
+
+    // the way splice does it: through a kernel-side buffer, not the caller's memory
+    ssize_t Sendfile(int outFd, int fd, off_t* off, size_t count)
+    {
+        std::vector<uint8_t> tmp(std::min<size_t>(count, 65536));
+        ssize_t res = off ? Pread(fd, tmp.data(), tmp.size(), *off) : Read(fd, tmp.data(), tmp.size());
+        if (res <= 0)
+        {
+            return res;
+        }
+        res = write(outFd, tmp.data(), res);
+        if ((res > 0) && off)
+        {
+            *off += res;
+        }
+        return res;
+    }
+
+    off_t Lseek(int, off_t off, int whence)
+    {
+        off_t base = (whence == SEEK_CUR) ? m_pos : (whence == SEEK_END) ? WINDOW_SIZE : 0;
+        if (((whence != SEEK_SET) && (whence != SEEK_CUR) && (whence != SEEK_END)) ||
+            (base + off < 0) || (base + off > WINDOW_SIZE))
+        {
+            return Fail(EINVAL);
+        }
+        m_pos = base + off;
+        return m_pos;
+    }
+
+    void* Mmap(int, size_t len, off_t off, int = PROT_WRITE|PROT_READ)
+    {
+        addr_selector sel = static_cast<addr_selector>(off / MMAP_REGION_SIZE);
+        off %= MMAP_REGION_SIZE;
+        if (sel == addr_selector::FPGA_ADDR_UNDEFINED)
+        {
+            sel = m_sel;
+        }
+        if ((sel == addr_selector::FPGA_ADDR_CS0) || (sel == addr_selector::FPGA_ADDR_CS1))
+        {
+            if (off + len > WINDOW_SIZE)
+            {
+                errno = EINVAL;
+                return MAP_FAILED;
+            }
+            return reinterpret_cast<uint8_t*>(Window(sel).data()) + off;
+        }
+        if (sel == addr_selector::FPGA_ADDR_DMA)
+        {
+            if (off + len > DMA_BUF_SIZE)
+            {
+                errno = EINVAL;
+                return MAP_FAILED;
+            }
+            return reinterpret_cast<uint8_t*>(m_dmaBuf.data()) + off;
+        }
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+
+    int Poll(pollfd* fds, nfds_t n, int timeoutMs)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        for (;;)
+        {
+            Tick();
+            short events = PollEvents();
+            for (nfds_t i = 0; i < n; i++)
+            {
+                fds[i].revents = events & (fds[i].events | POLLERR | POLLHUP);
+            }
+            if ((n && fds[0].revents) || !timeoutMs)
+            {
+                return (n && fds[0].revents) ? 1 : 0;
+            }
+            if ((timeoutMs > 0) && (std::chrono::steady_clock::now() >= deadline))
+            {
+                return 0;
+            }
+            WaitTick(timeoutMs);
+        }
+    }
+
+private:
+    int Fail(int err)
+    {
+        errno = err;
+        return -1;
+    }
+
+    // returns bytes to access at pos, clipped to the window
+    ssize_t DataLen(size_t len, off_t pos)
+    {
+        if (!DataSel() || (len & 0x1) || (pos & 0x1) || (pos < 0))
+        {
+            return Fail(EINVAL);
+        }
+        if (pos >= WINDOW_SIZE)
+        {
+            return 0;
+        }
+        return std::min<size_t>(len, WINDOW_SIZE - pos);
+    }
+
+    ssize_t DataRead(void* buf, size_t len, off_t pos)
+    {
+        ssize_t res = DataLen(len, pos);
+        uint16_t* out = static_cast<uint16_t*>(buf);
+        for (ssize_t i = 0; i < res / 2; i++)
+        {
+            out[i] = BusRead(m_sel, pos + i * sizeof(uint16_t));
+        }
+        return res;
+    }
+
+    ssize_t DataWrite(const void* buf, size_t len, off_t pos)
+    {
+        ssize_t res = DataLen(len, pos);
+        if (!res && len)
+        {
+            return Fail(ENOSPC);
+        }
+        const uint16_t* in = static_cast<const uint16_t*>(buf);
+        for (ssize_t i = 0; i < res / 2; i++)
+        {
+            BusWrite(m_sel, pos + i * sizeof(uint16_t), in[i]);
+        }
+        return res;
+    }
+
+    bool DataSel() const
+    {
+        return (m_sel == addr_selector::FPGA_ADDR_CS0) || (m_sel == addr_selector::FPGA_ADDR_CS1);
+    }
+
+    static bool ValidAddr(uint32_t addr)
+    {
+        return !(addr & 0x1) && (addr + sizeof(uint16_t) <= WINDOW_SIZE);
+    }
+
+    static bool InRam(addr_selector sel, uint32_t addr)
+    {
+        return (sel == addr_selector::FPGA_ADDR_CS0) && (addr >= RAM_START) && (addr < RAM_START + RAM_SIZE * 2);
+    }
+
+    // window memory holds the echo pattern, so mmap loads see what bus reads see
+    std::vector<uint16_t>& Window(addr_selector sel)
+    {
+        uint32_t cs = (sel == addr_selector::FPGA_ADDR_CS1) ? 1 : 0;
+        std::vector<uint16_t>& w = m_windows[cs];
+        if (w.empty())
+        {
+            w.resize(WINDOW_SIZE / sizeof(uint16_t));
+            for (uint32_t i = 0; i < w.size(); i++)
+            {
+                w[i] = static_cast<uint16_t>(i * sizeof(uint16_t)) | cs;
+            }
+            if (!cs)
+            {
+                ClearRam();
+            }
+        }
+        return w;
+    }
+
+    void ClearRam()
+    {
+        if (!m_windows[0].empty())
+        {
+            std::fill(m_windows[0].begin() + RAM_START / 2, m_windows[0].begin() + RAM_START / 2 + RAM_SIZE, 0);
+        }
+    }
+
+    uint16_t BusRead(addr_selector sel, uint32_t addr)
+    {
+        if (sel == addr_selector::FPGA_ADDR_CS0)
+        {
+            switch (addr)
+            {
+            case FPGA_REG_IRQ_STATUS: return m_irqStatus;
+            case FPGA_REG_IRQ_EVENTS: return m_irqEvents;
+            case FPGA_REG_IRQ_COUNT:  return m_irqCoalCount;
+            case FPGA_REG_IRQ_TIME:   return m_irqCoalTime;
+            default: break;
+            }
+        }
+        return Window(sel)[addr / sizeof(uint16_t)];
+    }
+
+    void BusWrite(addr_selector sel, uint32_t addr, uint16_t val)
+    {
+        if (InRam(sel, addr))
+        {
+            Window(sel)[addr / sizeof(uint16_t)] = val;
+        }
+        else if ((sel == addr_selector::FPGA_ADDR_CS0) && (addr <= FPGA_REG_IRQ_RAISE))
+        {
+            switch (addr)
+            {
+            case FPGA_REG_IRQ_STATUS: m_irqStatus &= ~val; break;
+            case FPGA_REG_IRQ_EVENTS: m_irqEvents -= std::min(val, m_irqEvents); break;
+            case FPGA_REG_IRQ_COUNT:  m_irqCoalCount = val; break;
+            case FPGA_REG_IRQ_TIME:   m_irqCoalTime = val; break;
+            case FPGA_REG_IRQ_RAISE:  IrqEvent(FPGA_IRQ_SRC_SOFT); break;
+            default: break;
+            }
+        }
+        else
+        {
+            m_stored = val;
+        }
+    }
+
+    void IrqEvent(uint32_t src)
+    {
+        if (!m_running)
+        {
+            return;
+        }
+        if (!m_irqEvents)
+        {
+            m_irqOldest = std::chrono::steady_clock::now();
+        }
+        m_irqStatus |= src;
+        m_irqEvents += (m_irqEvents != 0xFFFF) ? 1 : 0;
+        IrqUpdate();
+    }
+
+    // raise the line as the fpga does, driver's irq thread then acks every pending event
+    void IrqUpdate()
+    {
+        bool timeout = m_irqCoalTime && (std::chrono::steady_clock::now() - m_irqOldest >= IrqCoalTime());
+        if (!m_irqEvents || !m_irqEnabled || ((m_irqEvents < m_irqCoalCount) && !timeout))
+        {
+            return;
+        }
+        m_irqCount += m_irqEvents;
+        for (uint32_t i = 0; i < IRQ_SOURCES; i++)
+        {
+            if (m_irqStatus & (1u << i))
+            {
+                m_irqSrcCount[i]++;
+            }
+        }
+        m_irqEvents = 0;
+        m_irqStatus = 0;
+    }
+
+    std::chrono::nanoseconds IrqCoalTime() const
+    {
+        return std::chrono::nanoseconds((static_cast<uint64_t>(m_irqCoalTime) << IRQ_TIME_SHIFT) * 1000000000ull / FPGA_FREQ);
+    }
+
+    void SetHostIrq(bool level)
+    {
+        if (level && !m_hostIrq)
+        {
+            IrqEvent(FPGA_IRQ_SRC_HOST);
+        }
+        m_hostIrq = level;
+    }
+
+    void SetReset(bool released)
+    {
+        if (released && !m_running)
+        {
+            m_nextIrq = std::chrono::steady_clock::now() + m_irqPeriod;
+        }
+        if (!released)
+        {
+            m_irqStatus = 0;
+            m_irqEvents = 0;
+            ClearRam();
+        }
+        m_running = released;
+    }
+
+    void Tick()
+    {
+        if (!m_running)
+        {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (m_irqPeriod.count() && (now >= m_nextIrq))
+        {
+            IrqEvent(FPGA_IRQ_SRC_COUNTER);
+            m_nextIrq += m_irqPeriod;
+        }
+        // coalescing time may have run out
+        IrqUpdate();
+    }
+
+    // sleep till the next counter irq or for a while, false if nothing can ever happen
+    bool WaitTick(int timeoutMs)
+    {
+        bool timeoutDue = m_irqEvents && m_irqCoalTime;
+        if (!m_running || !m_irqEnabled || (!m_irqPeriod.count() && !timeoutDue))
+        {
+            if (timeoutMs)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return false;
+        }
+        auto next = m_irqPeriod.count() ? m_nextIrq : (m_irqOldest + IrqCoalTime());
+        if (timeoutDue)
+        {
+            next = std::min(next, m_irqOldest + IrqCoalTime());
+        }
+        auto wait = std::min<std::chrono::steady_clock::duration>(next - std::chrono::steady_clock::now(),
+                                                                  std::chrono::milliseconds(10));
+        if (wait.count() > 0)
+        {
+            std::this_thread::sleep_for(wait);
+        }
+        return true;
+    }
+
+    short PollEvents() const
+    {
+        bool irq = (m_irqCount != m_irqSeen);
+        switch (m_mode)
+        {
+        case file_mode::FPGA_MODE_IRQ:
+            return irq ? (POLLIN | POLLRDNORM) : 0;
+        case file_mode::FPGA_MODE_DMA:
+            return (m_completions.empty() ? 0 : (POLLIN | POLLRDNORM)) | (irq ? POLLPRI : 0);
+        case file_mode::FPGA_MODE_DATA:
+            return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM | (irq ? POLLPRI : 0);
+        default:
+            return POLLHUP;
+        }
+    }
+
+    // phys address to selector and window offset
+    bool DmaTarget(uint32_t phys, uint32_t len, addr_selector* sel, uint32_t* addr) const
+    {
+        if ((phys >= CS0_PHYS) && (phys < CS0_PHYS + WINDOW_SIZE))
+        {
+            *sel = addr_selector::FPGA_ADDR_CS0;
+            *addr = phys - CS0_PHYS;
+        }
+        else if ((phys >= CS1_PHYS) && (phys < CS1_PHYS + WINDOW_SIZE))
+        {
+            *sel = addr_selector::FPGA_ADDR_CS1;
+            *addr = phys - CS1_PHYS;
+        }
+        else
+        {
+            return false;
+        }
+        return !(*addr & 0x1) && !(len & 0x1) && (*addr + len <= WINDOW_SIZE);
+    }
+
+    bool DmaCopy(uint32_t phys, uint8_t* mem, uint32_t len, dma_dir d)
+    {
+        addr_selector sel;
+        uint32_t addr = 0;
+        if (!DmaTarget(phys, len, &sel, &addr))
+        {
+            return true;
+        }
+        if (d == dma_dir::DMA_FPGA_TO_ARM)
+        {
+            memcpy(mem, reinterpret_cast<uint8_t*>(Window(sel).data()) + addr, len);
+        }
+        else if (d == dma_dir::DMA_ARM_TO_FPGA)
+        {
+            for (uint32_t i = 0; i < len; i += sizeof(uint16_t))
+            {
+                uint16_t val;
+                memcpy(&val, mem + i, sizeof(val));
+                BusWrite(sel, addr + i, val);
+            }
+        }
+        else
+        {
+            return true;
+        }
+        return false;
+    }
+
+    int DmaSubmit(sk_fpga_dma_request* req)
+    {
+        uint8_t* mem = nullptr;
+        if (m_completions.size() >= DMA_RING_SIZE)
+        {
+            return Fail(EBUSY);
+        }
+        if (req->buf_id)
+        {
+            if ((req->buf_id > DMA_USER_BUFS) || !m_userBufs[req->buf_id - 1].addr ||
+                (req->buf_offset + req->len > m_userBufs[req->buf_id - 1].len))
+            {
+                return Fail(EINVAL);
+            }
+            mem = static_cast<uint8_t*>(m_userBufs[req->buf_id - 1].addr);
+        }
+        else
+        {
+            if (req->buf_offset + req->len > DMA_BUF_SIZE)
+            {
+                return Fail(EINVAL);
+            }
+            mem = reinterpret_cast<uint8_t*>(m_dmaBuf.data());
+        }
+        if (!req->len || DmaCopy(req->addr, mem + req->buf_offset, req->len, static_cast<dma_dir>(req->dir)))
+        {
+            return Fail(EINVAL);
+        }
+        req->cookie = ++m_cookie;
+        m_completions.push_back({req->cookie, 0});
+        return 0;
+    }
+
+    uint32_t ReapCompletions(sk_fpga_dma_completion* c, uint32_t max)
+    {
+        uint32_t num = 0;
+        while ((num < max) && !m_completions.empty())
+        {
+            c[num++] = m_completions.front();
+            m_completions.pop_front();
+        }
+        return num;
+    }
+
+    int DoBatch(sk_fpga_batch* b)
+    {
+        if (b->num > BATCH_MAX)
+        {
+            return Fail(EINVAL);
+        }
+        if (!b->num)
+        {
+            return 0;
+        }
+        if (!DataSel())
+        {
+            return Fail(EINVAL);
+        }
+        for (uint32_t i = 0; i < b->num; i++)
+        {
+            if (!ValidAddr(b->entries[i].address) || (b->entries[i].op >= static_cast<uint8_t>(fpga_op::FPGA_OP_LAST)))
+            {
+                return Fail(EINVAL);
+            }
+        }
+        for (uint32_t i = 0; i < b->num; i++)
+        {
+            sk_fpga_batch_entry& e = b->entries[i];
+            if (e.op == static_cast<uint8_t>(fpga_op::FPGA_OP_WRITE))
+            {
+                BusWrite(m_sel, e.address, e.data);
+            }
+            else
+            {
+                e.data = BusRead(m_sel, e.address);
+            }
+        }
+        return 0;
+    }
+
+    int DoCmdList(sk_fpga_cmd_list* l)
+    {
+        l->failed = -1;
+        if (l->num > CMD_MAX)
+        {
+            return Fail(EINVAL);
+        }
+        for (uint32_t i = 0; i < l->num; i++)
+        {
+            const sk_fpga_cmd& c = l->cmds[i];
+            bool bus = (c.op <= static_cast<uint8_t>(fpga_cmd_op::FPGA_CMD_WAIT));
+            if ((c.op >= static_cast<uint8_t>(fpga_cmd_op::FPGA_CMD_LAST)) || (c.arg > CMD_MAX_TIMEOUT_US) ||
+                (bus && (!DataSel() || !ValidAddr(c.address))))
+            {
+                l->failed = i;
+                return Fail(EINVAL);
+            }
+        }
+        int ret = 0;
+        for (uint32_t i = 0; (i < l->num) && !ret; i++)
+        {
+            const sk_fpga_cmd& c = l->cmds[i];
+            uint16_t result = 0;
+            switch (static_cast<fpga_cmd_op>(c.op))
+            {
+            case fpga_cmd_op::FPGA_CMD_READ:
+                result = BusRead(m_sel, c.address);
+                break;
+            case fpga_cmd_op::FPGA_CMD_WRITE:
+                BusWrite(m_sel, c.address, c.data);
+                break;
+            case fpga_cmd_op::FPGA_CMD_RMW:
+                result = (BusRead(m_sel, c.address) & ~c.mask) | (c.data & c.mask);
+                BusWrite(m_sel, c.address, result);
+                break;
+            case fpga_cmd_op::FPGA_CMD_WAIT:
+            {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(c.arg);
+                for (;;)
+                {
+                    Tick();
+                    result = BusRead(m_sel, c.address);
+                    if ((result & c.mask) == (c.data & c.mask))
+                    {
+                        break;
+                    }
+                    if (std::chrono::steady_clock::now() >= deadline)
+                    {
+                        ret = Fail(ETIMEDOUT);
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+                break;
+            }
+            case fpga_cmd_op::FPGA_CMD_DELAY:
+                std::this_thread::sleep_for(std::chrono::microseconds(c.arg));
+                break;
+            case fpga_cmd_op::FPGA_CMD_HOST_IRQ:
+                SetHostIrq(c.data != 0);
+                break;
+            case fpga_cmd_op::FPGA_CMD_RESET:
+                SetReset(c.data != 0);
+                break;
+            default:
+                break;
+            }
+            if (l->results)
+            {
+                l->results[i] = result;
+            }
+            if (ret)
+            {
+                l->failed = i;
+            }
+        }
+        return ret;
+    }
+
+    addr_selector m_sel = addr_selector::FPGA_ADDR_UNDEFINED;
+    file_mode m_mode = file_mode::FPGA_MODE_DATA;
+    off_t m_pos = 0;            // file position, offset in the selected window
+    sk_fpga_smc_timings m_smc[8] = {};
+    uint8_t m_smcNum = 0;
+    std::vector<uint16_t> m_windows[2];
+    std::vector<uint16_t> m_dmaBuf;
+    uint16_t m_stored = 0;
+    bool m_running = false;     // reset released
+    bool m_hostIrq = false;
+    bool m_progSession = false;
+    std::vector<std::string> m_bitCache; // hashes of loaded bitstreams
+    uint8_t m_bitHash[FPGA_BIT_HASH_LEN] = {};
+    bool m_bitLoaded = false;
+    uint16_t m_irqStatus = 0;   // fpga irq registers
+    uint16_t m_irqEvents = 0;
+    uint16_t m_irqCoalCount = 1;
+    uint16_t m_irqCoalTime = 0;
+    std::chrono::steady_clock::time_point m_irqOldest; // first of the pending events
+    uint32_t m_irqSrcCount[IRQ_SOURCES] = {};
+    uint32_t m_irqSrcSeen[IRQ_SOURCES] = {};
+    bool m_irqEnabled = false;  // driver registered its irq handler
+    uint32_t m_irqCount = 0;
+    uint32_t m_irqSeen = 0;
+    std::chrono::steady_clock::duration m_irqPeriod;
+    std::chrono::steady_clock::time_point m_nextIrq;
+    uint32_t m_cookie = 0;
+    std::deque<sk_fpga_dma_completion> m_completions;
+    sk_fpga_dma_buf m_userBufs[DMA_USER_BUFS] = {};
+};
+
+#endif
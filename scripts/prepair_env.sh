@@ -63,11 +63,13 @@ function make_link {
 
 DRIVER_C_SOURCE="fpga-sk-at91sam9m10g45-xc6slx.c"
 DRIVER_H_SOURCE="fpga-sk-at91sam9m10g45-xc6slx.h"
+DRIVER_TRACE_SOURCE="fpga-sk-at91sam9m10g45-xc6slx-trace.h"
 LINUX_DTS_SOURCE="sk_at91sam9m10g45ek_xc6slx.dts"
 LINUX_CONFIG_SOURCE="sk_at91_xc6slx_dt_defconfig"
 
 make_link "$THIS_DIR/../linux/kernel/dev_fpga" "$PATH_DRIVER_DST"  "$DRIVER_C_SOURCE"
 make_link "$THIS_DIR/../linux/kernel/dev_fpga" "$PATH_DRIVER_DST"  "$DRIVER_H_SOURCE"
+make_link "$THIS_DIR/../linux/kernel/dev_fpga" "$PATH_DRIVER_DST"  "$DRIVER_TRACE_SOURCE"
 make_link "$THIS_DIR/../linux/kernel/dts"      "$PATH_DTS_DST"     "$LINUX_DTS_SOURCE"
 make_link "$THIS_DIR/../linux/kernel/config"   "$PATH_CFG_DST"     "$LINUX_CONFIG_SOURCE"
 